@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,14 +7,40 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <string.h>
+#include <pthread.h>
 
-#define MAX_GROUPS 30
+#include "config.h"
+#include "group.h"
+#include "topology.h"
+#include "waiter.h"
 
 typedef struct {
     long mtype;
     int group_id;
     char text[256];
-} Message;
+} AppMessage;
+
+#define GROUP_THREAD_STACK (256 * 1024)
+
+/* Thread mode: a group runs on its own thread instead of in a groups.out process.
+   A group that failed after registering still reports termination, so the others
+   carry on. One that failed before validation knew of it never will, so the
+   thread posts the termination itself and the wait for every group still ends. */
+static void *group_thread(void *arg) {
+    const GroupConfig *cfg = arg;
+    int rc = run_group(cfg);
+    if (rc == GROUP_NOT_STARTED) {
+        fprintf(stderr, "Group %d failed to start\n", cfg->group_index);
+        AppMessage msg = { .mtype = 3, .group_id = cfg->group_index };
+        int msgid = msgget(cfg->app_key, 0666);
+        if (msgid == -1 || msgsnd(msgid, &msg, sizeof(msg) - sizeof(long), 0) == -1) {
+            perror("msgsnd group termination");
+        }
+    } else if (rc != 0) {
+        fprintf(stderr, "Group %d failed\n", cfg->group_index);
+    }
+    return NULL;
+}
 
 int main(int argc, char *argv[]) {
     if (argc != 2) {
@@ -28,53 +55,88 @@ int main(int argc, char *argv[]) {
     char input_file_path[128];
     snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
 
-    // Read from input.txt
-    FILE *fp = fopen(input_file_path, "r");
-    if (!fp) {
-        perror("Error opening input.txt");
-        exit(EXIT_FAILURE);
-    }
-
     int n, validation_key, app_key, moderator_key, violation_threshold;
+    char (*group_files)[256];
 
-    if (fscanf(fp, "%d %d %d %d %d", &n, &validation_key, &app_key, &moderator_key, &violation_threshold) != 5) {
-        fprintf(stderr, "Error reading input.txt: Invalid format\n");
-        fclose(fp);
-        exit(EXIT_FAILURE);
+    /* A compiled manifest (compile.out) already holds the keys and the group file
+       names, checked when it was built; otherwise parse input.txt and check each file. */
+    int replaying = env_str("CHATMOD_TRACE_REPLAY", NULL) != NULL;
+    Manifest manifest;
+    if (manifest_try_open(&manifest, testcase_folder, "app") == 0) {
+        const ManifestHeader *h = manifest.h;
+        n = h->ngroups;
+        validation_key = h->validation_key;
+        app_key = h->app_key;
+        moderator_key = h->moderator_key;
+        violation_threshold = h->violation_threshold;
+        group_files = calloc(n > 0 ? n : 1, sizeof(*group_files));
+        if (!group_files) {
+            perror("calloc group files");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < n; i++) {
+            const ManifestGroup *mg = manifest_group(&manifest, i);
+            if (!mg) {
+                fprintf(stderr, "Error: group %d is missing from the manifest\n", i);
+                exit(EXIT_FAILURE);
+            }
+            snprintf(group_files[i], sizeof(group_files[i]), "testcase_%s/%s", argv[1],
+                     manifest_string(&manifest, mg->path));
+        }
     }
+    else {
+        // Read from input.txt
+        FILE *fp = fopen(input_file_path, "r");
+        if (!fp) {
+            perror("Error opening input.txt");
+            exit(EXIT_FAILURE);
+        }
 
-    if (n > MAX_GROUPS) {
-        fprintf(stderr, "Number of groups exceeds maximum supported.\n");
-        fclose(fp);
-        exit(EXIT_FAILURE);
-    }
+        if (fscanf(fp, "%d %d %d %d %d", &n, &validation_key, &app_key, &moderator_key, &violation_threshold) != 5) {
+            fprintf(stderr, "Error reading input.txt: Invalid format\n");
+            fclose(fp);
+            exit(EXIT_FAILURE);
+        }
 
-    // Read group file paths and verify existence
-char group_files[MAX_GROUPS][256]; // Increased buffer size
-    for (int i = 0; i < n; i++) {
-        char group_file_name[128];
-        if (fscanf(fp, "%s", group_file_name) != 1) {
-            fprintf(stderr, "Error reading group file path from input.txt\n");
+        if (n < 0) {
+            fprintf(stderr, "Error reading input.txt: negative group count\n");
             fclose(fp);
             exit(EXIT_FAILURE);
         }
-int written = snprintf(group_files[i], sizeof(group_files[i]), "testcase_%s/%s", argv[1], group_file_name);
-if (written < 0 || written >= sizeof(group_files[i])) {
-    fprintf(stderr, "Error: Group file path too long, truncation occurred.\n");
-    fclose(fp);
-    exit(EXIT_FAILURE);
-}
 
-        // Verify file existence
-        FILE *test_fp = fopen(group_files[i], "r");
-        if (!test_fp) {
-            fprintf(stderr, "Error: Group file '%s' does not exist\n", group_files[i]);
+        // Read group file paths and verify existence; as many as input.txt lists
+        group_files = calloc(n > 0 ? n : 1, sizeof(*group_files));
+        if (!group_files) {
+            perror("calloc group files");
             fclose(fp);
             exit(EXIT_FAILURE);
         }
-        fclose(test_fp);
+        for (int i = 0; i < n; i++) {
+            char group_file_name[128];
+            if (fscanf(fp, "%s", group_file_name) != 1) {
+                fprintf(stderr, "Error reading group file path from input.txt\n");
+                fclose(fp);
+                exit(EXIT_FAILURE);
+            }
+            int written = snprintf(group_files[i], sizeof(group_files[i]), "testcase_%s/%s", argv[1], group_file_name);
+            if (written < 0 || written >= sizeof(group_files[i])) {
+                fprintf(stderr, "Error: Group file path too long, truncation occurred.\n");
+                fclose(fp);
+                exit(EXIT_FAILURE);
+            }
+
+            // Verify file existence (a replayed trace does not read group files)
+            if (replaying) continue;
+            FILE *test_fp = fopen(group_files[i], "r");
+            if (!test_fp) {
+                fprintf(stderr, "Error: Group file '%s' does not exist\n", group_files[i]);
+                fclose(fp);
+                exit(EXIT_FAILURE);
+            }
+            fclose(test_fp);
+        }
+        fclose(fp);
     }
-    fclose(fp);
 
     int msgid = msgget(app_key, IPC_CREAT | 0666);
     if (msgid == -1) {
@@ -82,15 +144,86 @@ if (written < 0 || written >= sizeof(group_files[i])) {
         exit(EXIT_FAILURE);
     }
 
+    /* CHATMOD_MODE=thread hosts every group on a thread of this process, and each
+       group reads its users' files itself instead of forking a process per user. */
+    int thread_mode = env_is("CHATMOD_MODE", "thread");
+    GroupConfig *group_cfgs = calloc(n > 0 ? n : 1, sizeof(GroupConfig));
+    pthread_t *group_tids = calloc(n > 0 ? n : 1, sizeof(pthread_t));
+    pid_t *group_pids = calloc(n > 0 ? n : 1, sizeof(pid_t));
+    if (!group_cfgs || !group_tids || !group_pids) {
+        perror("calloc group table");
+        exit(EXIT_FAILURE);
+    }
+    if (thread_mode) {
+        raise_fd_limit();  /* every group's pipes and FIFO live in this process */
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, GROUP_THREAD_STACK);
+
+    /* CHATMOD_PIN=on: each group runs on the CPUs of one cache domain, and the users
+       it forks inherit them; the cores the moderator takes are left out. */
+    Topology topo = { 0 };
+    Placement placement;
+    static int domains[CPU_SETSIZE];
+    int ndomains = 0;
+    if (topo_pinning()) {
+        if (topo_load(&topo) == 0) {
+            topo_place(&topo, &placement);
+            ndomains = topo_group_domains(&topo, &placement, domains, CPU_SETSIZE);
+            topo_print(&topo, &placement, "app");
+            for (int d = 0; d < ndomains && d < n; d++) {
+                cpu_set_t set;
+                char cpus[256];
+                topo_group_cpus(&topo, &placement, domains, ndomains, d, &set);
+                topo_format(&set, cpus, sizeof(cpus));
+                if (ndomains == 1) {
+                    fprintf(stderr, "app: all groups on cpus %s (cache domain %d)\n", cpus, domains[d]);
+                } else if (ndomains >= n) {
+                    fprintf(stderr, "app: group %d on cpus %s (cache domain %d)\n", d, cpus, domains[d]);
+                } else {
+                    fprintf(stderr, "app: groups %d, %d, ... (one in %d) on cpus %s (cache domain %d)\n", d,
+                            d + ndomains, ndomains, cpus, domains[d]);
+                }
+            }
+        } else {
+            fprintf(stderr, "app: CPU topology unavailable, groups are not pinned\n");
+        }
+    }
+
     /* Spawn each group */
-    pid_t group_pids[MAX_GROUPS];
     for (int i = 0; i < n; i++) {
+        cpu_set_t group_cpus;
+        if (ndomains > 0) topo_group_cpus(&topo, &placement, domains, ndomains, i, &group_cpus);
+        if (thread_mode) {
+            GroupConfig *cfg = &group_cfgs[i];
+            cfg->group_file = group_files[i];
+            cfg->group_index = i;
+            cfg->testcase_number = argv[1];
+            cfg->validation_key = validation_key;
+            cfg->app_key = app_key;
+            cfg->moderator_key = moderator_key;
+            cfg->violation_threshold = violation_threshold;
+            cfg->in_process = 1;
+            cfg->manifest = manifest.h ? &manifest : NULL;
+            if (ndomains > 0) pthread_attr_setaffinity_np(&attr, sizeof(group_cpus), &group_cpus);
+            if (pthread_create(&group_tids[i], &attr, group_thread, cfg) != 0) {
+                fprintf(stderr, "Error: could not start thread for group %d\n", i);
+                exit(EXIT_FAILURE);
+            }
+            printf("Spawned group %d\n", i);
+            continue;
+        }
+
         pid_t pid = fork();
         if (pid < 0) {
             perror("fork failed");
             exit(EXIT_FAILURE);
         } else if (pid == 0) { // Child process
-            char group_index_str[10];
+            if (ndomains > 0 && sched_setaffinity(0, sizeof(group_cpus), &group_cpus) < 0) {
+                perror("sched_setaffinity group");
+            }
+            char group_index_str[20];
             snprintf(group_index_str, sizeof(group_index_str), "%d", i);
             char val_key_str[20], app_key_str[20], mod_key_str[20], viol_str[20];
             snprintf(val_key_str, sizeof(val_key_str), "%d", validation_key);
@@ -121,16 +254,32 @@ if (written < 0 || written >= sizeof(group_files[i])) {
         printf("Spawned group %d\n", i);
     }
 
+    pthread_attr_destroy(&attr);
+
     int active_groups = n;
+    Waiter waiter;
+    waiter_init(&waiter);
     while (active_groups > 0) {
-        Message msg;
-        if (msgrcv(msgid, &msg, sizeof(msg) - sizeof(long), 3, 0) > 0) {
+        AppMessage msg;
+        if (waiter_msgrcv(&waiter, msgid, &msg, sizeof(msg) - sizeof(long), 3) > 0) {
             printf("All users terminated. Exiting group process %d.\n", msg.group_id);
             active_groups--;
         }
     }
 
+    if (thread_mode) {
+        for (int i = 0; i < n; i++) {
+            pthread_join(group_tids[i], NULL);
+        }
+    }
+
     msgctl(msgid, IPC_RMID, NULL);
+    free(group_pids);
+    free(group_tids);
+    free(group_cfgs);
+    free(group_files);
+    manifest_close(&manifest);
+    topo_free(&topo);
 
     return 0;
 }
@@ -0,0 +1,65 @@
+/***************************************************
+ * batch.h
+ *
+ * Batched group -> moderator submission (CHATMOD_BATCH > 1, System V
+ * transport). Instead of one msgsnd() per chat message, a group packs up to
+ * CHATMOD_BATCH messages into one ChatBatch and sends it when the batch is
+ * full or its oldest message has waited CHATMOD_BATCH_DEADLINE_US. Entries
+ * are packed back to back: a BatchEntry header, then `len` bytes of text.
+ *
+ * Validation still gets one Message per chat message; only the moderator's
+ * side is batched.
+ ***************************************************/
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define BATCH_MTYPE 4          /* 1/2/3 are group/user/termination notices */
+#define BATCH_BYTES 8000       /* packed entries per batch; keeps under the default msgmax of 8192 */
+#define BATCH_DEFAULT_DEADLINE_US 2000
+
+typedef struct __attribute__((packed)) {
+    int32_t timestamp;
+    int32_t user;
+    uint32_t sent_us;
+    uint16_t len;
+} BatchEntry;
+
+typedef struct {
+    long mtype;                /* BATCH_MTYPE */
+    int32_t group;
+    uint32_t count;
+    char data[BATCH_BYTES];
+} ChatBatch;
+
+/* Bytes to pass to msgsnd() for a batch holding `used` bytes of entries. */
+static inline size_t batch_msgsz(size_t used) {
+    return offsetof(ChatBatch, data) - sizeof(long) + used;
+}
+
+/* Append one entry. Returns 0 if it does not fit. */
+static inline int batch_add(ChatBatch *b, size_t *used, int32_t timestamp, int32_t user,
+                            uint32_t sent_us, const char *text, uint16_t len) {
+    if (*used + sizeof(BatchEntry) + len > BATCH_BYTES) return 0;
+    BatchEntry e = { timestamp, user, sent_us, len };
+    memcpy(b->data + *used, &e, sizeof(e));
+    memcpy(b->data + *used + sizeof(e), text, len);
+    *used += sizeof(e) + len;
+    b->count++;
+    return 1;
+}
+
+/* Walk a received batch of `used` bytes. Returns 0 when there are no more entries. */
+static inline int batch_next(const ChatBatch *b, size_t used, size_t *off, BatchEntry *e, const char **text) {
+    if (*off + sizeof(BatchEntry) > used) return 0;
+    memcpy(e, b->data + *off, sizeof(*e));
+    if (*off + sizeof(BatchEntry) + e->len > used) return 0;
+    *text = b->data + *off + sizeof(BatchEntry);
+    *off += sizeof(BatchEntry) + e->len;
+    return 1;
+}
+
+#endif /* BATCH_H */
@@ -0,0 +1,359 @@
+/***************************************************
+ * bench.c
+ *
+ * End-to-end benchmark. Generates a synthetic testcase of the requested
+ * shape, then runs moderator.out and app.out on it with this program standing
+ * in for validation.out (it drains the validation queue and tells the app
+ * when each group is done). Reports delivered messages per second, latency
+ * from user write to moderator verdict, and the peak RSS of each side.
+ *
+ *   ./bench.out [-g groups] [-u users] [-m messages] [-l length]
+ *               [-d density] [-w words] [-t threshold] [-n name] [-s seed] [-R]
+ *
+ * Run it from the directory holding app.out, groups.out and moderator.out.
+ * CHATMOD_* variables are passed through, so the same testcase can be timed
+ * under different transports and modes.
+ ***************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "config.h"
+#include "group.h"
+#include "latency.h"
+#include "transport.h"
+
+typedef struct {
+    long mtype;
+    int group_id;
+    char text[256];
+} AppMessage;
+
+typedef struct {
+    int groups;
+    int users;          /* per group */
+    int messages;       /* per user */
+    int length;         /* characters per message */
+    double density;     /* fraction of messages carrying a filtered word */
+    int words;          /* filtered words in the dictionary */
+    int threshold;
+    const char *name;   /* testcase_<name> */
+    uint64_t seed;
+    int reuse;          /* run an existing testcase_<name> as is */
+} BenchConfig;
+
+static uint64_t rng_state;
+
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static int rng_below(int n) {
+    return (int)(rng_next() % (uint64_t)n);
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void random_letters(char *dst, int n, int mixed_case) {
+    for (int i = 0; i < n; i++) {
+        char c = 'a' + rng_below(26);
+        dst[i] = (mixed_case && rng_below(2)) ? c - 'a' + 'A' : c;
+    }
+}
+
+static FILE *open_or_die(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+static void make_dir(const char *path) {
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Write testcase_<name>: input.txt, filtered_words.txt, groups/ and users/. */
+static void generate(const BenchConfig *bc) {
+    char dir[256], path[512];
+    snprintf(dir, sizeof(dir), "testcase_%s", bc->name);
+    make_dir(dir);
+    snprintf(path, sizeof(path), "%s/groups", dir);
+    make_dir(path);
+    snprintf(path, sizeof(path), "%s/users", dir);
+    make_dir(path);
+    /* A manifest compiled from an earlier generation no longer describes this one. */
+    snprintf(path, sizeof(path), "%s/manifest.bin", dir);
+    unlink(path);
+
+    /* Keys differ per run so a stale queue from an earlier run is never picked up. */
+    int base = 0x6200 + (int)(getpid() % 4000) * 3;
+    snprintf(path, sizeof(path), "%s/input.txt", dir);
+    FILE *f = open_or_die(path);
+    fprintf(f, "%d\n%d\n%d\n%d\n%d\n", bc->groups, base, base + 1, base + 2, bc->threshold);
+    for (int g = 0; g < bc->groups; g++) fprintf(f, "groups/group_%d.txt\n", g);
+    fclose(f);
+
+    char (*words)[9] = calloc(bc->words > 0 ? bc->words : 1, sizeof(*words));
+    if (!words) {
+        perror("calloc words");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, sizeof(path), "%s/filtered_words.txt", dir);
+    f = open_or_die(path);
+    for (int w = 0; w < bc->words; w++) {
+        int len = 5 + rng_below(4);
+        random_letters(words[w], len, 0);
+        fprintf(f, "%s\n", words[w]);
+    }
+    fclose(f);
+
+    char text[MAX_TEXT_SIZE];
+    for (int g = 0; g < bc->groups; g++) {
+        snprintf(path, sizeof(path), "%s/groups/group_%d.txt", dir, g);
+        FILE *gf = open_or_die(path);
+        fprintf(gf, "%d\n", bc->users);
+        for (int u = 0; u < bc->users; u++) {
+            fprintf(gf, "users/user_%d_%d.txt\n", g, u);
+            snprintf(path, sizeof(path), "%s/users/user_%d_%d.txt", dir, g, u);
+            FILE *uf = open_or_die(path);
+            int ts = 0;
+            for (int k = 0; k < bc->messages; k++) {
+                ts += 1 + rng_below(10);
+                random_letters(text, bc->length, 1);
+                text[bc->length] = '\0';
+                if (bc->words > 0 && (double)rng_next() / (double)UINT64_MAX < bc->density) {
+                    const char *w = words[rng_below(bc->words)];
+                    int wl = (int)strlen(w);
+                    int at = bc->length > wl ? rng_below(bc->length - wl + 1) : 0;
+                    for (int i = 0; i < wl && at + i < MAX_TEXT_SIZE - 1; i++) {
+                        text[at + i] = rng_below(2) ? w[i] - 'a' + 'A' : w[i];
+                    }
+                    if (at + wl > bc->length) text[at + wl] = '\0';
+                }
+                fprintf(uf, "%d %s\n", ts, text);
+            }
+            fclose(uf);
+        }
+        fclose(gf);
+    }
+    free(words);
+}
+
+/* fork + exec ./<prog>.out <name>, with its stdout discarded. */
+static pid_t spawn(const char *prog, const char *name) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        if (devnull >= 0) dup2(devnull, STDOUT_FILENO);
+        char path[64];
+        snprintf(path, sizeof(path), "./%s.out", prog);
+        execl(path, path, name, (char *)NULL);
+        perror(path);
+        _exit(EXIT_FAILURE);
+    }
+    return pid;
+}
+
+/* Fresh queue for `key`, dropping one left behind by an earlier run. */
+static int fresh_queue(int key) {
+    int q = msgget(key, 0666);
+    if (q >= 0) msgctl(q, IPC_RMID, NULL);
+    q = msgget(key, IPC_CREAT | 0666);
+    if (q < 0) {
+        perror("msgget");
+        exit(EXIT_FAILURE);
+    }
+    return q;
+}
+
+static void on_child(int sig) {
+    (void)sig;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+            "Usage: %s [-g groups] [-u users] [-m messages] [-l length] [-d density]\n"
+            "          [-w words] [-t threshold] [-n name] [-s seed] [-R]\n", argv0);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig bc = {
+        .groups = 8, .users = 16, .messages = 200, .length = 32,
+        .density = 0.05, .words = 50, .threshold = 5, .name = "bench", .seed = 1,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "g:u:m:l:d:w:t:n:s:R")) != -1) {
+        switch (opt) {
+        case 'g': bc.groups = atoi(optarg); break;
+        case 'u': bc.users = atoi(optarg); break;
+        case 'm': bc.messages = atoi(optarg); break;
+        case 'l': bc.length = atoi(optarg); break;
+        case 'd': bc.density = atof(optarg); break;
+        case 'w': bc.words = atoi(optarg); break;
+        case 't': bc.threshold = atoi(optarg); break;
+        case 'n': bc.name = optarg; break;
+        case 's': bc.seed = strtoull(optarg, NULL, 10); break;
+        case 'R': bc.reuse = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (bc.groups < 1 || bc.users < 1 || bc.messages < 0 || bc.length < 1 ||
+        bc.length >= MAX_TEXT_SIZE || bc.words < 0) {
+        usage(argv[0]);
+    }
+    rng_state = bc.seed ? bc.seed : 1;
+
+    if (!bc.reuse) {
+        double g0 = now_seconds();
+        generate(&bc);
+        printf("generated testcase_%s in %.2f s\n", bc.name, now_seconds() - g0);
+    }
+
+    char path[512];
+    snprintf(path, sizeof(path), "testcase_%s/input.txt", bc.name);
+    FILE *fp = fopen(path, "r");
+    int n, validation_key, app_key, moderator_key, threshold;
+    if (!fp || fscanf(fp, "%d %d %d %d %d", &n, &validation_key, &app_key, &moderator_key, &threshold) != 5) {
+        fprintf(stderr, "Error reading %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+
+    int val_msqid = fresh_queue(validation_key);
+    int mod_msqid = fresh_queue(moderator_key);
+    int app_msqid = fresh_queue(app_key);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_child;  /* no SA_RESTART: a dying child interrupts msgrcv() */
+    sigaction(SIGCHLD, &sa, NULL);
+    /* Groups and users outlive app.out's interest in them; adopt them so their
+       peak RSS can be collected too. */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
+    char latency_file[64];
+    snprintf(latency_file, sizeof(latency_file), "/tmp/chatmod_latency_%d", (int)getpid());
+    setenv("CHATMOD_LATENCY_FILE", latency_file, 1);
+
+    pid_t mod_pid = spawn("moderator", bc.name);
+    if (env_is("CHATMOD_TRANSPORT", "shm")) {
+        /* Groups attach to the moderator's segment, so it has to exist first. */
+        ShmHeader *shm = NULL;
+        for (int tries = 0; tries < 5000 && !shm; tries++) {
+            shm = shm_transport_attach(moderator_key);
+            if (!shm) usleep(1000);
+        }
+        if (!shm) {
+            fprintf(stderr, "moderator did not create its shared memory segment\n");
+            kill(mod_pid, SIGTERM);
+            exit(EXIT_FAILURE);
+        }
+        munmap(shm, shm_transport_bytes(shm));
+    }
+
+    double t0 = now_seconds();
+    pid_t app_pid = spawn("app", bc.name);
+
+    /* Validation's side: count chats, and pass each group's termination on to the app. */
+    long chats = 0, users = 0, removed = 0;
+    int done = 0, app_status = 0, app_gone = 0;
+    struct rusage app_ru, mod_ru, ru;
+    memset(&mod_ru, 0, sizeof(mod_ru));
+    while (done < n) {
+        Message m;
+        if (msgrcv(val_msqid, &m, sizeof(m) - sizeof(long), 0, 0) < 0) {
+            if (errno != EINTR) {
+                perror("msgrcv validation");
+                break;
+            }
+            if (wait4(app_pid, &app_status, WNOHANG, &app_ru) == app_pid) {
+                app_gone = 1;
+                fprintf(stderr, "app.out exited before all groups finished\n");
+                break;
+            }
+            continue;
+        }
+        if (m.mtype == 2) {
+            users++;
+        } else if (m.mtype == 3) {
+            removed += m.user;
+            done++;
+            AppMessage a = { .mtype = 3, .group_id = m.modifyingGroup };
+            msgsnd(app_msqid, &a, sizeof(a) - sizeof(long), 0);
+        } else if (m.mtype >= CHAT_MTYPE_BASE) {
+            chats++;
+        }
+    }
+    if (!app_gone) {
+        while (wait4(app_pid, &app_status, 0, &app_ru) < 0 && errno == EINTR) {
+        }
+    }
+    double elapsed = now_seconds() - t0;
+
+    /* Let the moderator work through its backlog before stopping it. */
+    struct msqid_ds qs;
+    while (msgctl(mod_msqid, IPC_STAT, &qs) == 0 && qs.msg_qnum > 0) {
+        usleep(1000);
+    }
+    kill(mod_pid, SIGTERM);
+    long app_rss = app_ru.ru_maxrss;
+    pid_t pid;
+    while ((pid = wait4(-1, NULL, 0, &ru)) > 0 || errno == EINTR) {
+        if (pid == mod_pid) {
+            mod_ru = ru;
+        } else if (pid > 0 && ru.ru_maxrss > app_rss) {
+            app_rss = ru.ru_maxrss;
+        }
+    }
+    double drained = now_seconds() - t0;
+
+    LatencyHist lat;
+    if (lat_load(&lat, latency_file) < 0) {
+        fprintf(stderr, "no latency data from the moderator\n");
+    }
+    unlink(latency_file);
+    msgctl(val_msqid, IPC_RMID, NULL);
+    msgctl(mod_msqid, IPC_RMID, NULL);
+    msgctl(app_msqid, IPC_RMID, NULL);
+
+    printf("testcase_%s: %d groups, %ld users, transport %s, mode %s\n", bc.name, n, users,
+           env_str("CHATMOD_TRANSPORT", "sysv"), env_str("CHATMOD_MODE", "process"));
+    printf("delivered   %ld messages in %.3f s (%.0f msg/s), %ld users removed\n",
+           chats, elapsed, elapsed > 0 ? chats / elapsed : 0.0, removed);
+    printf("moderated   %llu messages, last verdict at %.3f s\n", (unsigned long long)lat.count, drained);
+    printf("latency us  p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+           (unsigned long long)lat_quantile(&lat, 0.50), (unsigned long long)lat_quantile(&lat, 0.99),
+           (unsigned long long)lat_quantile(&lat, 0.999), (unsigned long long)lat_quantile(&lat, 1.0));
+    printf("peak rss KB app %ld (largest of app/groups/users), moderator %ld\n",
+           app_rss, mod_ru.ru_maxrss);
+
+    return (WIFEXITED(app_status) && WEXITSTATUS(app_status) == 0 && done == n) ? 0 : EXIT_FAILURE;
+}
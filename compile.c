@@ -0,0 +1,203 @@
+/***************************************************
+ * compile.c
+ *
+ * Compiles a testcase into testcase_<N>/manifest.bin (see manifest.h): the
+ * keys from input.txt, every group's user file list and the automaton for
+ * filtered_words.txt, laid out to be mapped read-only by app.out, groups.out
+ * and moderator.out.
+ *
+ *   ./compile.out <testcase_number>
+ *
+ * Run it again after changing the testcase; a manifest older than input.txt
+ * or filtered_words.txt is ignored, but edits to group files are not noticed.
+ ***************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "manifest.h"
+#include "matcher.h"
+
+typedef struct {
+    char *data;
+    size_t len, cap;
+} Buf;
+
+/* Append `n` bytes; returns their offset, or -1 when out of memory. */
+static long buf_put(Buf *b, const void *p, size_t n) {
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n) cap *= 2;
+        char *d = realloc(b->data, cap);
+        if (!d) return -1;
+        b->data = d;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, n);
+    b->len += n;
+    return (long)(b->len - n);
+}
+
+static long buf_put_string(Buf *b, const char *s) {
+    return buf_put(b, s, strlen(s) + 1);
+}
+
+static void die(const char *what) {
+    fprintf(stderr, "compile: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+/* Place a section of `len` bytes at the next aligned offset. */
+static void place(ManifestSection *s, uint64_t *end, uint64_t len) {
+    s->off = (*end + MANIFEST_ALIGN - 1) & ~(uint64_t)(MANIFEST_ALIGN - 1);
+    s->len = len;
+    *end = s->off + len;
+}
+
+static void write_section(FILE *out, const ManifestSection *s, const void *data) {
+    static const char zeros[MANIFEST_ALIGN];
+    long at = ftell(out);
+    if (at < 0 || (uint64_t)at > s->off) die("layout error");
+    if (fwrite(zeros, 1, (size_t)(s->off - (uint64_t)at), out) != s->off - (uint64_t)at ||
+        (s->len && fwrite(data, 1, s->len, out) != s->len)) {
+        die(strerror(errno));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <testcase_number>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    char testcase_folder[64];
+    snprintf(testcase_folder, sizeof(testcase_folder), "./testcase_%s", argv[1]);
+
+    ManifestHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = MANIFEST_MAGIC;
+    h.matcher_size = sizeof(Matcher);
+
+    /* Sources are stat'ed before they are read, so an edit made while this runs
+       leaves the manifest stale rather than quietly out of date. */
+    char input_path[128], words_path[128];
+    snprintf(input_path, sizeof(input_path), "%s/input.txt", testcase_folder);
+    snprintf(words_path, sizeof(words_path), "%s/filtered_words.txt", testcase_folder);
+    struct stat st;
+    if (stat(input_path, &st) < 0) {
+        perror(input_path);
+        exit(EXIT_FAILURE);
+    }
+    manifest_source_of(&st, &h.input);
+    if (stat(words_path, &st) < 0) {
+        perror(words_path);
+        exit(EXIT_FAILURE);
+    }
+    manifest_source_of(&st, &h.words);
+
+    FILE *fp = fopen(input_path, "r");
+    if (!fp || fscanf(fp, "%d %d %d %d %d", &h.ngroups, &h.validation_key, &h.app_key,
+                      &h.moderator_key, &h.violation_threshold) != 5 || h.ngroups < 0) {
+        fprintf(stderr, "Error reading %s: Invalid format\n", input_path);
+        exit(EXIT_FAILURE);
+    }
+
+    Buf groups = {0}, users = {0}, strings = {0};
+    if (buf_put(&strings, "", 1) < 0) die("out of memory");   /* offset 0 is "" */
+    for (int g = 0; g < h.ngroups; g++) {
+        char group_name[128], group_path[256];
+        if (fscanf(fp, "%127s", group_name) != 1) {
+            fprintf(stderr, "Error reading group file path from %s\n", input_path);
+            exit(EXIT_FAILURE);
+        }
+        snprintf(group_path, sizeof(group_path), "%s/%s", testcase_folder, group_name);
+        FILE *gf = fopen(group_path, "r");
+        if (!gf) {
+            fprintf(stderr, "Error: Group file '%s' does not exist\n", group_path);
+            exit(EXIT_FAILURE);
+        }
+        int nusers;
+        if (fscanf(gf, "%d", &nusers) != 1 || nusers < 0) {
+            fprintf(stderr, "Error: bad user count in %s\n", group_path);
+            exit(EXIT_FAILURE);
+        }
+        long path = buf_put_string(&strings, group_name);
+        ManifestGroup mg = { (uint32_t)path, h.nusers, (uint32_t)nusers };
+        if (path < 0 || buf_put(&groups, &mg, sizeof(mg)) < 0) die("out of memory");
+        for (int i = 0; i < nusers; i++) {
+            char user_name[128];
+            if (fscanf(gf, "%127s", user_name) != 1) {
+                fprintf(stderr, "Error: %s lists %d users but names fewer\n", group_path, nusers);
+                exit(EXIT_FAILURE);
+            }
+            long off = buf_put_string(&strings, user_name);
+            uint32_t u = (uint32_t)off;
+            if (off < 0 || buf_put(&users, &u, sizeof(u)) < 0) die("out of memory");
+        }
+        h.nusers += (uint32_t)nusers;
+        fclose(gf);
+    }
+    fclose(fp);
+    if (strings.len > UINT32_MAX) die("too many file names");
+
+    /* Always with the whole-word set: the moderator picks the mode when it starts. */
+    Matcher m;
+    if (matcher_load(&m, words_path, MATCH_WORD) < 0) {
+        perror(words_path);
+        exit(EXIT_FAILURE);
+    }
+    size_t tok_text_len = 1;
+    for (uint32_t i = 0; i <= m.tok_mask; i++) {
+        const MatcherToken *t = &m.tok[i];
+        if (t->hash && t->off + t->len > tok_text_len) tok_text_len = t->off + t->len;
+    }
+
+    uint64_t end = sizeof(h);
+    place(&h.groups, &end, groups.len);
+    place(&h.users, &end, users.len);
+    place(&h.strings, &end, strings.len);
+    place(&h.delta, &end, (uint64_t)m.nstates * m.nclasses * sizeof(int32_t));
+    place(&h.word, &end, (uint64_t)m.nstates * sizeof(int32_t));
+    place(&h.link, &end, (uint64_t)m.nstates * sizeof(int32_t));
+    place(&h.tok, &end, ((uint64_t)m.tok_mask + 1) * sizeof(MatcherToken));
+    place(&h.tok_text, &end, tok_text_len);
+    h.matcher = m;
+    h.matcher.delta = h.matcher.word = h.matcher.link = NULL;
+    h.matcher.tok = NULL;
+    h.matcher.tok_text = NULL;
+
+    /* Written beside the old one and renamed over it, so a process starting
+       meanwhile maps either the old manifest or the new, never half of one. */
+    char path[256], tmp[256];
+    snprintf(path, sizeof(path), "%s/manifest.bin", testcase_folder);
+    snprintf(tmp, sizeof(tmp), "%s/manifest.bin.%d", testcase_folder, (int)getpid());
+    FILE *out = fopen(tmp, "wb");
+    if (!out) {
+        perror(tmp);
+        exit(EXIT_FAILURE);
+    }
+    if (fwrite(&h, sizeof(h), 1, out) != 1) die(strerror(errno));
+    write_section(out, &h.groups, groups.data);
+    write_section(out, &h.users, users.data);
+    write_section(out, &h.strings, strings.data);
+    write_section(out, &h.delta, m.delta);
+    write_section(out, &h.word, m.word);
+    write_section(out, &h.link, m.link);
+    write_section(out, &h.tok, m.tok);
+    write_section(out, &h.tok_text, m.tok_text);
+    if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0 || rename(tmp, path) != 0) {
+        perror(path);
+        unlink(tmp);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s: %d groups, %u users, %d words (%d states), %llu bytes\n", path, h.ngroups, h.nusers,
+           m.nwords, m.nstates, (unsigned long long)end);
+    matcher_free(&m);
+    free(groups.data);
+    free(users.data);
+    free(strings.data);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/***************************************************
+ * config.h
+ *
+ * Tunables are read from CHATMOD_* environment variables so they reach
+ * groups.out through app.out's fork+exec without changing any argv.
+ ***************************************************/
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline const char *env_str(const char *name, const char *def) {
+    const char *v = getenv(name);
+    return (v && *v) ? v : def;
+}
+
+static inline long env_long(const char *name, long def) {
+    const char *v = getenv(name);
+    if (!v || !*v) return def;
+    char *end;
+    long x = strtol(v, &end, 10);
+    return *end ? def : x;
+}
+
+/* True if the variable is set to `value` (case-sensitive). */
+static inline int env_is(const char *name, const char *value) {
+    const char *v = getenv(name);
+    return v && strcmp(v, value) == 0;
+}
+
+#endif /* CONFIG_H */
@@ -0,0 +1,59 @@
+/***************************************************
+ * flow.h
+ *
+ * Credit-based flow control for a group's forwarding. Before forwarding, a
+ * group asks for a grant: how many messages fit downstream right now (free
+ * bytes on the System V queues, free slots in its shm ring, and the room its
+ * moderator shard advertises), split with the other live groups. It spends
+ * the credits without asking again, so there is one estimate per grant rather
+ * than per message, and grants shrink smoothly as the queues fill. An empty
+ * grant means waiting FLOW_BACKOFF_MS before asking again, while the group
+ * keeps reading its users until their rings fill and their pipes push back
+ * on them. (Longer or growing waits left the CPU idle once the consumers had
+ * caught up.)
+ *
+ * Credits are an estimate, not a reservation: groups sharing a queue can
+ * still overcommit it, and then msgsnd() just blocks as before.
+ *
+ * Users are not credited. A user's window is already fixed: its ring in the
+ * group and its pipe, and once both are full its write() blocks. A group
+ * with no grant stops draining the rings, so the hold travels back to the
+ * users through them, and the merge keeps every user's head in view, which
+ * a per-user share of the grant would starve.
+ ***************************************************/
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#define FLOW_BACKOFF_MS 1
+#define FLOW_UNKNOWN UINT32_MAX   /* room that could not be measured: do not hold back */
+
+typedef struct {
+    uint32_t credits;       /* messages that may go out before the next grant */
+    uint32_t backoff_ms;    /* wait before asking again: FLOW_BACKOFF_MS after an empty grant, else 0 */
+} FlowControl;
+
+/* Messages of `per_msg` payload bytes that fit on a System V queue right now. */
+static inline uint32_t flow_queue_room(int msqid, size_t per_msg) {
+    struct msqid_ds qs;
+    if (msgctl(msqid, IPC_STAT, &qs) < 0) return FLOW_UNKNOWN;
+    if (qs.msg_cbytes >= qs.msg_qbytes) return 0;
+    return (uint32_t)((qs.msg_qbytes - qs.msg_cbytes) / per_msg);
+}
+
+static inline uint32_t flow_min(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+/* Turn the room downstream into credits. Returns the grant. */
+static inline uint32_t flow_grant(FlowControl *f, uint32_t room) {
+    f->credits = room;
+    f->backoff_ms = room ? 0 : FLOW_BACKOFF_MS;
+    return room;
+}
+
+#endif /* FLOW_H */
@@ -0,0 +1,1137 @@
+/***************************************************
+ * group.h
+ *
+ * One chat group: reads its group file (or the compiled manifest), starts its
+ * users, merges their messages by timestamp and forwards them to validation
+ * and the moderator.
+ * groups.out runs one of these per process; app.out can instead run every
+ * group on its own thread (CHATMOD_MODE=thread), with users read in-process.
+ ***************************************************/
+#ifndef GROUP_H
+#define GROUP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+
+#include "batch.h"
+#include "config.h"
+#include "flow.h"
+#include "latency.h"
+#include "manifest.h"
+#include "stats.h"
+#include "trace.h"
+#include "transport.h"
+#include "userfile.h"
+#include "waiter.h"
+
+#define MAX_TEXT_SIZE 256
+#define CHAT_MTYPE_BASE 30     /* chat messages go out as mtype 30 + group, as validation expects */
+#define GROUP_NOT_STARTED 2    /* run_group() failed before validation knew of the group */
+
+typedef struct {
+    long mtype;
+    int timestamp;
+    int user;
+    char mtext[256];
+    int modifyingGroup;
+    uint32_t sent_us;  /* lat_now_us() when the user wrote it; sits in what was tail padding */
+} Message;
+
+/* validation.out was built against the struct without sent_us. */
+_Static_assert(sizeof(Message) == 280, "Message must keep the size validation expects");
+
+/* For communication from group to moderator, or vice versa */
+typedef struct {
+    long mtype;        /* Could be the group ID or some known type */
+    int group_id;
+    int user_id;
+    int removeUser;    /* 1 if user is to be removed, 0 otherwise */
+} ModMessage;
+
+/* Record on the user -> group pipe: this header followed by len bytes of text
+   (no terminator). Both ends run on the same host, so native byte order is fine. */
+typedef struct __attribute__((packed)) {
+    int32_t timestamp;
+    int32_t user;
+    uint16_t len;
+    uint32_t sent_us;  /* stamped by the user when the batch is written */
+} PipeRecord;
+
+#define USER_BATCH 32          /* records per writev() from a user */
+#define PIPE_RING_SIZE 8192    /* per-user receive ring in the group, power of two */
+
+/* Receive ring for one user pipe. head/tail are running byte counts. */
+typedef struct {
+    char data[PIPE_RING_SIZE];
+    size_t head;   /* next byte to parse */
+    size_t tail;   /* next byte to fill */
+} PipeRing;
+
+/* Where a user stands in the timestamp merge. */
+enum {
+    USER_PENDING,  /* active, but no complete record buffered yet */
+    USER_QUEUED,   /* head record is in the merge heap */
+    USER_DONE      /* finished or removed */
+};
+
+/* One user's stream as the merge sees it. In process mode the records arrive
+   over the user's pipe into a ring; in-process, the group walks the user's
+   mapped file and the head record is just a view into the mapping. */
+typedef struct {
+    int in_process;
+    int fd;          /* process mode: pipe read end, -1 once closed */
+    PipeRing *ring;  /* process mode: received bytes */
+    UserFile file;   /* in-process mode: the user's file */
+    UserLine head;   /* in-process mode: next line, valid if has_head */
+    uint32_t head_sent_us;
+    int has_head;
+    int state;       /* USER_PENDING / USER_QUEUED / USER_DONE */
+    int eof;         /* no more input; buffered records may remain */
+    int paused;      /* ring full, EPOLLIN disabled */
+} UserStream;
+
+/* Everything a group needs to hand messages on. */
+typedef struct {
+    int group_index;
+    int val_msqid;
+    int mod_msqid;
+    SpscRing *mod_ring;   /* CHATMOD_TRANSPORT=shm: ring to the moderator */
+    Doorbell *mod_bell;   /* and the owning shard's doorbell */
+    GroupCounters *stats;
+    ChatBatch *batch;     /* CHATMOD_BATCH > 1: messages not yet sent to the moderator */
+    size_t batch_used;
+    uint32_t batch_max;
+    uint64_t batch_deadline_ns;
+    uint64_t batch_started_ns;   /* when the oldest message in `batch` was added */
+    FlowControl flow;
+    Message out;          /* where chat messages are built when not in an shm ring slot */
+} GroupLink;
+
+/* The moderator's stats segment as one group uses it. The moderator may still be
+   starting up, so a missing segment is looked for again each interval. */
+typedef struct {
+    StatsHeader *header;  /* NULL until attached */
+    uint64_t published;   /* when the counters last went out */
+    int counted_live;     /* this group is in header->live_groups */
+} GroupStatsLink;
+
+/* How to run one group; filled from groups.out's argv or by app.c in thread mode. */
+typedef struct {
+    const char *group_file;       /* full path, e.g. testcase_1/groups/group_0.txt */
+    int group_index;
+    const char *testcase_number;
+    int validation_key;
+    int app_key;
+    int moderator_key;
+    int violation_threshold;
+    int in_process;               /* read user files on this thread instead of forking users */
+    const Manifest *manifest;     /* compiled testcase, or NULL to read group_file */
+} GroupConfig;
+
+/* Merge heap entry: the head record of one user's stream. */
+typedef struct {
+    int timestamp;
+    int user;
+} HeapEntry;
+
+/* epoll tag for the moderator control FIFO; user pipes are tagged with their index. */
+#define REMOVAL_TAG 0xFFFFFFFFu
+
+#define MERGE_BATCH 64   /* messages forwarded between checks of the control FIFO */
+#define GROUP_EPOLL_EVENTS 64  /* events taken per epoll_wait(); any number of users may be registered */
+
+/* writev() that keeps going after short writes. */
+static inline int writev_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t w = writev(fd, iov, iovcnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return 0;
+}
+
+/* Pull whatever the pipe has into the ring. Returns bytes read, 0 on EOF, -1 on error/EAGAIN. */
+static inline ssize_t ring_fill(PipeRing *r, int fd) {
+    size_t used = r->tail - r->head;
+    size_t space = PIPE_RING_SIZE - used;
+    if (space == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    size_t off = r->tail & (PIPE_RING_SIZE - 1);
+    size_t first = PIPE_RING_SIZE - off;
+    if (first > space) first = space;
+    struct iovec iov[2] = {
+        { r->data + off, first },
+        { r->data, space - first },
+    };
+    ssize_t n = readv(fd, iov, space > first ? 2 : 1);
+    if (n > 0) r->tail += n;
+    return n;
+}
+
+/* Copy len bytes starting at running offset pos out of the ring. */
+static inline void ring_copy(const PipeRing *r, size_t pos, void *dst, size_t len) {
+    size_t off = pos & (PIPE_RING_SIZE - 1);
+    size_t first = PIPE_RING_SIZE - off;
+    if (first > len) first = len;
+    memcpy(dst, r->data + off, first);
+    memcpy((char *)dst + first, r->data, len - first);
+}
+
+/* Read the header of the next record without consuming it. Returns 0 if it is not complete yet. */
+static inline int ring_peek(const PipeRing *r, PipeRecord *rec) {
+    size_t used = r->tail - r->head;
+    if (used < sizeof(PipeRecord)) return 0;
+    ring_copy(r, r->head, rec, sizeof(PipeRecord));
+    return used >= sizeof(PipeRecord) + rec->len;
+}
+
+/* Pop one complete record; text is NUL-terminated. Returns 0 if none is complete yet. */
+static inline int ring_pop(PipeRing *r, PipeRecord *rec, char *text) {
+    size_t used = r->tail - r->head;
+    if (used < sizeof(PipeRecord)) return 0;
+    ring_copy(r, r->head, rec, sizeof(PipeRecord));
+    if (used < sizeof(PipeRecord) + rec->len) return 0;
+    ring_copy(r, r->head + sizeof(PipeRecord), text, rec->len);
+    text[rec->len] = '\0';
+    r->head += sizeof(PipeRecord) + rec->len;
+    return 1;
+}
+
+static inline int heap_less(const HeapEntry *a, const HeapEntry *b) {
+    if (a->timestamp != b->timestamp) return a->timestamp < b->timestamp;
+    return a->user < b->user;
+}
+
+static inline void heap_push(HeapEntry *heap, int *size, HeapEntry e) {
+    int i = (*size)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_less(&e, &heap[parent])) break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i] = e;
+}
+
+static inline HeapEntry heap_pop(HeapEntry *heap, int *size) {
+    HeapEntry top = heap[0];
+    HeapEntry last = heap[--(*size)];
+    int i = 0;
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && heap_less(&heap[child + 1], &heap[child])) child++;
+        if (!heap_less(&heap[child], &last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    if (*size > 0) heap[i] = last;
+    return top;
+}
+
+/* Head record of a stream, if a complete one is available. In-process streams
+   pull the next line out of the mapping; everything before it has been forwarded,
+   so those pages can be let go. */
+static inline int stream_head(UserStream *us, int user, PipeRecord *rec) {
+    if (!us->in_process) return ring_peek(us->ring, rec);
+    if (!us->has_head) {
+        userfile_release(&us->file, us->file.pos);
+        if (us->eof || !userfile_next(&us->file, &us->head)) {
+            us->eof = 1;
+            return 0;
+        }
+        us->has_head = 1;
+        us->head_sent_us = lat_now_us();
+    }
+    rec->timestamp = us->head.timestamp;
+    rec->user = user;
+    rec->len = us->head.len;
+    rec->sent_us = us->head_sent_us;
+    return 1;
+}
+
+/* Consume the head record. `*text` (not terminated) points into `buf` for piped
+   users and straight into the mapping for in-process ones. */
+static inline int stream_take(UserStream *us, int user, PipeRecord *rec, const char **text, char *buf) {
+    if (!us->in_process) {
+        if (!ring_pop(us->ring, rec, buf)) return 0;
+        *text = buf;
+        return 1;
+    }
+    if (!stream_head(us, user, rec)) return 0;
+    *text = us->head.text;
+    us->has_head = 0;
+    return 1;
+}
+
+/* Stamp a batch of records with the time it is written, then write it. */
+static inline int user_flush(int fd, PipeRecord *hdrs, struct iovec *iov, int batched) {
+    uint32_t now = lat_now_us();
+    for (int b = 0; b < batched; b++) hdrs[b].sent_us = now;
+    return writev_all(fd, iov, 2 * batched);
+}
+
+/* User process body (process mode): stream the mapped file down the pipe, then exit.
+   Each batch goes out with one writev() whose text iovecs point into the mapping. */
+static inline void run_user_process(const char *user_file_path, int user, int fd) {
+    UserFile uf;
+    if (userfile_open(&uf, user_file_path) < 0) {
+        fprintf(stderr, "Error opening user file: %s\n", user_file_path);
+        perror("open user_file");
+        exit(EXIT_FAILURE);
+    }
+    PipeRecord hdrs[USER_BATCH];
+    struct iovec iov[2 * USER_BATCH];
+    int batched = 0;
+
+    /* For each line, read <timestamp> <message> */
+    UserLine line;
+    while (userfile_next(&uf, &line)) {
+        hdrs[batched].timestamp = line.timestamp;
+        hdrs[batched].user = user;
+        hdrs[batched].len = line.len;
+        iov[2 * batched].iov_base = &hdrs[batched];
+        iov[2 * batched].iov_len = sizeof(PipeRecord);
+        iov[2 * batched + 1].iov_base = (void *)line.text;
+        iov[2 * batched + 1].iov_len = line.len;
+        batched++;
+
+        if (batched == USER_BATCH) {
+            if (user_flush(fd, hdrs, iov, batched) < 0) {
+                perror("write to pipe");
+            }
+            batched = 0;
+            userfile_release(&uf, uf.pos);
+        }
+    }
+    if (batched > 0 && user_flush(fd, hdrs, iov, batched) < 0) {
+        perror("write to pipe");
+    }
+    userfile_close(&uf);
+
+    /* Once done sending, close the write end. This signals the group process that no more data. */
+    close(fd);
+    exit(0);
+}
+
+/* msgsnd() that notes when the queue was full and it had to wait. */
+static inline int queue_send(int msqid, const void *msg, size_t size, uint64_t *blocked) {
+    if (msgsnd(msqid, msg, size, IPC_NOWAIT) == 0) return 0;
+    if (errno != EAGAIN) return -1;
+    (*blocked)++;
+    return msgsnd(msqid, msg, size, 0);
+}
+
+/* The moderator's stats segment, if it has one with a slot for this group. */
+static inline StatsHeader *group_stats_attach(int moderator_key, int group_index) {
+    StatsHeader *stats = stats_attach(moderator_key, 1);
+    if (stats && (uint32_t)group_index >= stats->ngroups) {
+        stats_detach(stats);
+        stats = NULL;
+    }
+    return stats;
+}
+
+/* Copy the group's counters into its stats slot, sampling queue depths on the way. */
+static inline void group_stats_publish(StatsHeader *stats, const GroupLink *link) {
+    struct msqid_ds qs;
+    GroupCounters *c = link->stats;
+    if (msgctl(link->val_msqid, IPC_STAT, &qs) == 0) c->val_depth = qs.msg_qnum;
+    if (!link->mod_ring && msgctl(link->mod_msqid, IPC_STAT, &qs) == 0) c->mod_depth = qs.msg_qnum;
+
+    GroupSlot *slot = stats_group(stats, link->group_index);
+    stats_write_begin(&slot->seq);
+    slot->updated_ns = stats_now_ns();
+    slot->c = *c;
+    stats_write_end(&slot->seq);
+}
+
+/* Once per interval: attach if need be, count the group as live, publish its counters. */
+static inline void group_stats_tick(GroupStatsLink *gs, const GroupLink *link, int moderator_key, uint64_t now) {
+    if (now - gs->published < STATS_INTERVAL_NS) return;
+    if (!gs->header) gs->header = group_stats_attach(moderator_key, link->group_index);
+    if (gs->header && !gs->counted_live) {
+        atomic_fetch_add(&gs->header->live_groups, 1);
+        gs->counted_live = 1;
+    }
+    if (gs->header) group_stats_publish(gs->header, link);
+    gs->published = now;
+}
+
+/* Ask for credits for the next stretch of forwarding (see flow.h): the tighter
+   of validation's and the moderator's room, each split with the other live groups. */
+static inline uint32_t group_flow_grant(GroupLink *link, StatsHeader *stats) {
+    uint32_t share = 1;
+    if (stats) {
+        uint32_t live = atomic_load_explicit(&stats->live_groups, memory_order_relaxed);
+        if (live > 1) share = live;
+    }
+    uint32_t val_room = flow_queue_room(link->val_msqid, sizeof(Message) - sizeof(long));
+    if (val_room != FLOW_UNKNOWN) val_room = (val_room + share - 1) / share;
+
+    uint32_t mod_room;
+    if (link->mod_ring) {
+        /* The ring is this group's alone. */
+        mod_room = link->mod_ring->mask + 1 - spsc_depth(link->mod_ring);
+    } else {
+        /* Batched messages travel as BatchEntry + text; assume short texts. */
+        size_t per_msg = link->batch ? sizeof(BatchEntry) + MAX_TEXT_SIZE / 8 : sizeof(Message) - sizeof(long);
+        mod_room = flow_queue_room(link->mod_msqid, per_msg);
+        if (mod_room != FLOW_UNKNOWN) {
+            if (stats) {
+                ShardSlot *shard = stats_shard(stats, (uint32_t)link->group_index % stats->nshards);
+                mod_room += atomic_load_explicit(&shard->room, memory_order_relaxed);
+            }
+            mod_room = (mod_room + share - 1) / share;
+        }
+    }
+
+    uint32_t granted = flow_grant(&link->flow, flow_min(val_room, mod_room));
+    if (!granted) link->stats->throttled++;
+    return granted;
+}
+
+/* Send the pending batch to the moderator, if there is one. */
+static inline void batch_flush(GroupLink *link) {
+    if (!link->batch || link->batch->count == 0) return;
+    queue_send(link->mod_msqid, link->batch, batch_msgsz(link->batch_used), &link->stats->send_blocked);
+    link->stats->batches++;
+    link->batch->count = 0;
+    link->batch_used = 0;
+}
+
+/* Milliseconds epoll may sleep before the pending batch is due, -1 if there is none. */
+static inline int batch_timeout_ms(const GroupLink *link, uint64_t now) {
+    if (!link->batch || link->batch->count == 0) return -1;
+    uint64_t due = link->batch_started_ns + link->batch_deadline_ns;
+    if (now >= due) return 0;
+    return (int)((due - now + 999999) / 1000000);
+}
+
+/* Queue one message for the moderator, sending the batch once it is full. */
+static inline void batch_push(GroupLink *link, const Message *msg, uint16_t len) {
+    if (link->batch->count == 0) link->batch_started_ns = stats_now_ns();
+    if (!batch_add(link->batch, &link->batch_used, msg->timestamp, msg->user, msg->sent_us, msg->mtext, len)) {
+        batch_flush(link);
+        link->batch_started_ns = stats_now_ns();
+        batch_add(link->batch, &link->batch_used, msg->timestamp, msg->user, msg->sent_us, msg->mtext, len);
+    }
+    if (link->batch->count >= link->batch_max) batch_flush(link);
+}
+
+/* Where the next chat message is built: directly in the shm ring slot it will
+   travel in (waiting for one if the ring is full), otherwise the link's own record.
+   Nothing is committed until forward_chat(). */
+static inline Message *chat_slot(GroupLink *link) {
+    if (!link->mod_ring) return &link->out;
+    Message *slot = spsc_reserve(link->mod_ring);
+    if (!slot) {
+        link->stats->ring_full++;
+        while (!(slot = spsc_reserve(link->mod_ring))) {
+            spsc_wait_space(link->mod_ring);
+        }
+    }
+    return slot;
+}
+
+/* (E)+(F): hand one chat message, built in `msg` from chat_slot(), to validation and
+   to the moderator. `text` is copied in unless it was already taken into msg->mtext.
+   Returns -1 if validation is gone. */
+static inline int forward_chat(GroupLink *link, Message *msg, const PipeRecord *rec, const char *text) {
+    msg->mtype = CHAT_MTYPE_BASE + link->group_index; // e.g., 30 + group_index
+    msg->timestamp = rec->timestamp;
+    msg->user = rec->user;
+    if (text != msg->mtext) memcpy(msg->mtext, text, rec->len);
+    msg->mtext[rec->len] = '\0';
+    msg->modifyingGroup = link->group_index;
+    msg->sent_us = rec->sent_us;
+
+    if (queue_send(link->val_msqid, msg, sizeof(*msg) - sizeof(long), &link->stats->send_blocked) == -1) {
+        perror("msgsnd chat message");
+        return -1;
+    }
+
+    /* Same record to the moderator: publishing the ring slot it was built in, if there is one. */
+    if (link->mod_ring) {
+        if (spsc_publish(link->mod_ring)) {
+            doorbell_ring(link->mod_bell);
+        }
+    } else if (link->batch) {
+        batch_push(link, msg, rec->len);
+    } else {
+        queue_send(link->mod_msqid, msg, sizeof(*msg) - sizeof(msg->mtype), &link->stats->send_blocked);
+    }
+    link->stats->forwarded++;
+    return 0;
+}
+
+/* Stop reading a user (EOF, removal or error). */
+static inline void stream_close(UserStream *us, int epfd) {
+    if (us->fd >= 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, us->fd, NULL);
+        close(us->fd);
+        us->fd = -1;
+    }
+}
+
+/* Drop whatever the stream still buffers or maps. */
+static inline void stream_free(UserStream *us) {
+    if (us->in_process) {
+        userfile_close(&us->file);
+        us->has_head = 0;
+    }
+    free(us->ring);
+    us->ring = NULL;
+}
+
+/* `<dir>/group_<g>.trace`, where a group's trace is recorded and replayed from. */
+static inline void trace_path(char *buf, size_t n, const char *dir, int group_index) {
+    snprintf(buf, n, "%s/group_%d.trace", dir, group_index);
+}
+
+/* Add a forwarded message to the trace being recorded; on a write error, say so and stop recording. */
+static inline void group_record(TraceWriter **trace, const PipeRecord *rec, const char *text) {
+    if (*trace && trace_append(*trace, rec->user, rec->timestamp, text, rec->len) < 0) {
+        perror("recording CHATMOD_TRACE_RECORD");
+        trace_writer_free(*trace);
+        *trace = NULL;
+    }
+}
+
+/* CHATMOD_TRACE_SPEED: replay pace as a multiple of the recorded one; "max" does not pace. */
+static inline double trace_replay_speed(void) {
+    const char *s = env_str("CHATMOD_TRACE_SPEED", "1");
+    if (strcmp(s, "max") == 0) return 0;
+    double x = strtod(s, NULL);
+    return x > 0 ? x : 1;
+}
+
+/* When a record recorded at `at_us` is due, for a replay that began at `started`. */
+static inline uint64_t trace_due_ns(uint64_t started, uint64_t at_us, double speed) {
+    return speed > 0 ? started + (uint64_t)((double)at_us * 1000.0 / speed) : started;
+}
+
+/* CHATMOD_TRACE_REPLAY: forward a recorded trace in place of the users. A user stops
+   after its last recorded message or when the moderator removes it, and the group ends
+   once fewer than two are left, as it would have live. Returns 0 or EXIT_FAILURE. */
+static inline int replay_trace(TraceReader *tr, GroupLink *link, GroupStatsLink *gstats, int moderator_key,
+                               int epfd, int ctl_fd, TraceWriter **record, int *removed_count) {
+    uint32_t nusers = tr->header.nusers;
+    uint32_t *left = malloc((nusers > 0 ? nusers : 1) * sizeof(uint32_t));   /* messages still to come */
+    if (!left) {
+        perror("malloc replay state");
+        return EXIT_FAILURE;
+    }
+    int total_active = 0;
+    for (uint32_t u = 0; u < nusers; u++) {
+        left[u] = tr->counts[u];
+        if (left[u]) total_active++;
+    }
+    double speed = trace_replay_speed();
+    uint64_t started = stats_now_ns();
+    struct epoll_event events[GROUP_EPOLL_EVENTS];
+    Waiter waiter;
+    waiter_init(&waiter);
+
+    TraceRecord rec;
+    int have = trace_next(tr, &rec);
+    int status = 0;
+    while (total_active >= 2 && have > 0 && status == 0) {
+        uint64_t now = stats_now_ns();
+        group_stats_tick(gstats, link, moderator_key, now);
+        if (batch_timeout_ms(link, now) == 0) batch_flush(link);
+
+        /* Sleep until the next record is due, credits may be back, or the batch is. */
+        uint64_t due = trace_due_ns(started, rec.at_us, speed);
+        int hold = 0;
+        if (due > now) hold = (int)((due - now + 999999) / 1000000);
+        else if (!link->flow.credits) hold = (int)link->flow.backoff_ms;
+        int timeout = batch_timeout_ms(link, now);
+        if (hold == 0) timeout = 0;
+        else if (timeout < 0 || hold < timeout) timeout = hold;
+        int nev = waiter_epoll(&waiter, epfd, events, GROUP_EPOLL_EVENTS, timeout);
+        if (nev < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            status = EXIT_FAILURE;
+            break;
+        }
+        if (nev > 0) {
+            ModMessage m;
+            while (read(ctl_fd, &m, sizeof(m)) == sizeof(m)) {
+                int uid = m.user_id;
+                if (m.removeUser == 1 && m.group_id == link->group_index && uid >= 0 && (uint32_t)uid < nusers && left[uid]) {
+                    left[uid] = 0;
+                    total_active--;
+                    (*removed_count)++;
+                    link->stats->removed++;
+                }
+            }
+        }
+
+        now = stats_now_ns();
+        for (int sent = 0; sent < MERGE_BATCH && have > 0 && total_active >= 2; ) {
+            if (trace_due_ns(started, rec.at_us, speed) > now) break;
+            if (!left[rec.user]) {   /* removed */
+                have = trace_next(tr, &rec);
+                continue;
+            }
+            if (!link->flow.credits && !group_flow_grant(link, gstats->header)) break;
+            PipeRecord pr = { rec.timestamp, rec.user, rec.len < MAX_TEXT_SIZE ? rec.len : MAX_TEXT_SIZE - 1,
+                              lat_now_us() };
+            group_record(record, &pr, rec.text);
+            if (forward_chat(link, chat_slot(link), &pr, rec.text) < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            link->flow.credits--;
+            sent++;
+            if (--left[rec.user] == 0) total_active--;
+            have = trace_next(tr, &rec);
+        }
+    }
+    if (have < 0) {
+        fprintf(stderr, "Error: the trace for group %d is damaged\n", link->group_index);
+        status = EXIT_FAILURE;
+    }
+    free(left);
+    return status;
+}
+
+/* The group's user file names, from the manifest when there is one, else from the
+   group file. Returns the user count (*out is calloc'd), or -1. */
+static inline int load_user_files(const GroupConfig *cfg, char (**out)[128]) {
+    if (cfg->manifest) {
+        const ManifestGroup *mg = manifest_group(cfg->manifest, cfg->group_index);
+        if (!mg) {
+            fprintf(stderr, "Error: group %d is missing from the manifest\n", cfg->group_index);
+            return -1;
+        }
+        char (*user_files)[128] = calloc(mg->nusers ? mg->nusers : 1, sizeof(*user_files));
+        if (!user_files) {
+            perror("calloc user files");
+            return -1;
+        }
+        for (uint32_t i = 0; i < mg->nusers; i++) {
+            snprintf(user_files[i], sizeof(user_files[i]), "%s", manifest_user_file(cfg->manifest, mg, i));
+        }
+        *out = user_files;
+        return (int)mg->nusers;
+    }
+
+    /* Open group file and read #users + user file paths */
+    FILE *gf = fopen(cfg->group_file, "r");
+    if (!gf) {
+        perror("fopen group_file");
+        return -1;
+    }
+
+    int initial_users;
+    if (fscanf(gf, "%d", &initial_users) != 1 || initial_users < 0) {
+        fprintf(stderr, "Error: bad user count in %s\n", cfg->group_file);
+        fclose(gf);
+        return -1;
+    }
+    /* Sized from the group file, so a group can have as many users as it lists. */
+    char (*user_files)[128] = calloc(initial_users > 0 ? initial_users : 1, sizeof(*user_files));
+    if (!user_files) {
+        perror("calloc user files");
+        fclose(gf);
+        return -1;
+    }
+    for (int i = 0; i < initial_users; i++) {
+        if (fscanf(gf, "%127s", user_files[i]) != 1) {
+            fprintf(stderr, "Error: %s lists %d users but names fewer\n", cfg->group_file, initial_users);
+            free(user_files);
+            fclose(gf);
+            return -1;
+        }
+    }
+    fclose(gf);
+    *out = user_files;
+    return initial_users;
+}
+
+/* Run one group to completion: register with validation, start its users, merge
+   and forward their messages, then report termination. Returns 0, EXIT_FAILURE, or
+   GROUP_NOT_STARTED if it failed before validation knew of it. Once registered, a
+   group always reports termination, even when it fails, so the run can finish. */
+static inline int run_group(const GroupConfig *cfg) {
+    int group_index = cfg->group_index;
+    int moderator_key = cfg->moderator_key;
+
+    /* Everything released on the way out, set up front so any failure can jump there. */
+    int status = GROUP_NOT_STARTED;
+    int registered = 0;          /* mtype 1 went to validation, so mtype 3 must follow */
+    int user_removed_count = 0;  // how many were removed for violations
+    int initial_users = 0;
+    char (*user_files)[128] = NULL;
+    TraceReader replay;
+    int replaying = 0;
+    TraceWriter recorder;
+    TraceWriter *record = NULL;
+    _Alignas(STATS_CACHELINE) GroupCounters counters;
+    memset(&counters, 0, sizeof(counters));
+    GroupLink link = { .group_index = group_index, .stats = &counters, .val_msqid = -1, .mod_msqid = -1 };
+    GroupStatsLink gstats = { NULL, 0, 0 };  /* counters go to the moderator's stats segment when there is one */
+    pid_t *user_pids = NULL;
+    UserStream *users = NULL;
+    HeapEntry *heap = NULL;
+    int epfd = -1, ctl_fd = -1;
+
+    /* CHATMOD_TRACE_REPLAY: the users' messages come from a recorded trace instead,
+       so the group file and the users' files are not needed at all. */
+    const char *replay_dir = env_str("CHATMOD_TRACE_REPLAY", NULL);
+    if (replay_dir) {
+        char path[256];
+        trace_path(path, sizeof(path), replay_dir, group_index);
+        if (trace_open(&replay, path) < 0) {
+            fprintf(stderr, "Error: cannot replay %s: %s\n", path, strerror(errno));
+            goto out;
+        }
+        replaying = 1;
+    }
+
+    if (replaying) {
+        initial_users = (int)replay.header.nusers;
+    } else {
+        initial_users = load_user_files(cfg, &user_files);
+        if (initial_users < 0) {
+            initial_users = 0;
+            goto out;
+        }
+    }
+
+    /* CHATMOD_TRACE_RECORD: keep a trace of everything this group forwards. */
+    const char *record_dir = env_str("CHATMOD_TRACE_RECORD", NULL);
+    if (record_dir) {
+        char path[256];
+        trace_path(path, sizeof(path), record_dir, group_index);
+        mkdir(record_dir, 0755);
+        if (trace_create(&recorder, path, (uint32_t)group_index, (uint32_t)initial_users) == 0) {
+            record = &recorder;
+        } else {
+            fprintf(stderr, "Warning: cannot record %s: %s\n", path, strerror(errno));
+            trace_writer_free(&recorder);
+        }
+    }
+
+    /* ========== CREATE MESSAGE QUEUES ========== */
+    counters.users = (uint32_t)initial_users;
+
+    /* The group needs to send messages to the validation queue, so get its ID: */
+    link.val_msqid = msgget(cfg->validation_key, 0666);
+    if (link.val_msqid < 0) {
+        perror("msgget validation");
+        goto out;
+    }
+
+    /* The group sends messages to the moderator: */
+    link.mod_msqid = msgget(moderator_key, 0666);
+    if (link.mod_msqid < 0) {
+        perror("msgget moderator");
+        goto out;
+    }
+
+    if (env_is("CHATMOD_TRANSPORT", "shm")) {
+        ShmHeader *shm = shm_transport_attach(moderator_key);
+        if (!shm || (uint32_t)group_index >= shm->ngroups || shm->slot_size != sizeof(Message)) {
+            fprintf(stderr, "Error: shared memory transport unavailable (start the moderator with CHATMOD_TRANSPORT=shm first)\n");
+            goto out;
+        }
+        link.mod_ring = shm_transport_ring(shm, group_index);
+        link.mod_bell = shm_transport_bell(shm, group_index % shm->nshards);
+    }
+    else if (env_long("CHATMOD_BATCH", 1) > 1) {
+        /* Batching trades up to the deadline in latency for far fewer msgsnd() calls.
+           The shm transport has no per-message syscall to save, so it never batches. */
+        link.batch = calloc(1, sizeof(ChatBatch));
+        if (!link.batch) {
+            perror("calloc batch");
+            goto out;
+        }
+        link.batch->mtype = BATCH_MTYPE;
+        link.batch->group = group_index;
+        link.batch_max = (uint32_t)env_long("CHATMOD_BATCH", 1);
+        link.batch_deadline_ns = (uint64_t)env_long("CHATMOD_BATCH_DEADLINE_US", BATCH_DEFAULT_DEADLINE_US) * 1000;
+    }
+
+    /* The group may optionally communicate with the app via a queue: */
+    int app_msqid = msgget(cfg->app_key, 0666);
+    if (app_msqid < 0) {
+        perror("msgget app");
+        // not necessarily fatal—depends on your design
+        goto out;
+    }
+
+    /* ========== NOTIFY VALIDATION: GROUP CREATED (mtype = 1) ========== */
+    Message createMsg;
+    createMsg.mtype = 1;
+    createMsg.timestamp = 0;   // ignored
+    createMsg.user = 0;        // ignored
+    createMsg.mtext[0] = '\0'; // ignored
+    createMsg.modifyingGroup = group_index;
+
+    if (msgsnd(link.val_msqid, &createMsg, sizeof(createMsg) - sizeof(createMsg.mtype), 0) == -1) {
+        perror("msgsnd group creation");
+        // If validation fails, might as well exit
+        goto out;
+    }
+    registered = 1;
+    status = EXIT_FAILURE;  /* until the merge loop starts */
+
+    /* We also maintain arrays to track user streams and statuses. */
+    user_pids = calloc(initial_users > 0 ? initial_users : 1, sizeof(pid_t));
+    users = calloc(initial_users > 0 ? initial_users : 1, sizeof(UserStream));
+    heap = calloc(initial_users > 0 ? initial_users : 1, sizeof(HeapEntry));
+    int heap_size = 0;
+    if (!user_pids || !users || !heap) {
+        perror("calloc merge state");
+        goto out;
+    }
+    for (int i = 0; i < initial_users; i++) {
+        users[i].fd = -1;   /* users not started yet have nothing to close */
+        user_pids[i] = -1;
+    }
+
+    /* ========== CREATE USERS ========== */
+    /* Process mode forks one process per user, each writing to its own pipe.
+       In-process mode just opens the user's file; this thread reads it directly. */
+    for(int i = 0; i < initial_users; i++){
+        char user_file_path[256];
+
+        if (replaying) {
+            /* Nothing to start: the trace speaks for this user. */
+        }
+        else if (cfg->in_process) {
+            snprintf(user_file_path, sizeof(user_file_path), "testcase_%s/%s", cfg->testcase_number, user_files[i]);
+            users[i].in_process = 1;
+            if (userfile_open(&users[i].file, user_file_path) < 0) {
+                fprintf(stderr, "Error opening user file: %s\n", user_file_path);
+                goto out;
+            }
+        }
+        else {
+            snprintf(user_file_path, sizeof(user_file_path), "testcase_%s/%s", cfg->testcase_number, user_files[i]);
+            /* Create pipe for user i -> group */
+            int fds[2];
+            if (pipe(fds) < 0) {
+                perror("pipe");
+                goto out;
+            }
+
+            pid_t cpid = fork();
+            if (cpid < 0) {
+                perror("fork user");
+                close(fds[0]);
+                close(fds[1]);
+                goto out;
+            }
+            else if (cpid == 0) {
+                /* CHILD = user process */
+                close(fds[0]); // child won't read from pipe, only write
+                run_user_process(user_file_path, i, fds[1]);
+            }
+
+            /* PARENT (group) side */
+            close(fds[1]); // group won't write to the pipe, only read
+            users[i].fd = fds[0];
+            user_pids[i] = cpid;
+            users[i].ring = calloc(1, sizeof(PipeRing));
+            if (!users[i].ring) {
+                perror("calloc pipe ring");
+                goto out;
+            }
+        }
+
+        /* ========== NOTIFY VALIDATION: NEW USER (mtype = 2) ========== */
+        Message userMsg;
+        userMsg.mtype = 2;
+        userMsg.timestamp = 0; // ignored
+        userMsg.user = i;      // user index
+        memset(userMsg.mtext, 0, sizeof(userMsg.mtext));
+        userMsg.modifyingGroup = group_index;
+
+        if (msgsnd(link.val_msqid, &userMsg, sizeof(userMsg) - sizeof(userMsg.mtype), 0) == -1) {
+            perror("msgsnd new user");
+            goto out;
+        }
+    }
+    free(user_files);
+    user_files = NULL;
+
+    /* ========== READ MESSAGES FROM USERS, FORWARD TO VALIDATION & MODERATOR ========== */
+    /* All user pipes and the control FIFO are registered with one epoll instance, so the
+       group sleeps until some user has data (or a removal arrives) instead of blocking on
+       whichever pipe happens to be next in a round-robin pass.
+
+       Each user's file is in timestamp order, so the group does a k-way merge: a message is
+       forwarded only once every still-active user has a record buffered (or has finished),
+       and then the smallest timestamp goes first. A user whose ring fills up is taken out of
+       the epoll set until the merge consumes from it, which bounds buffering per user and
+       pushes back on that user through its pipe. In-process users never make the merge
+       wait: their next line is always one parse away in the mapping. */
+
+    int total_active = initial_users;
+    int pending = initial_users;  /* active users the merge is waiting on */
+
+    epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        goto out;
+    }
+
+    for (int i = 0; i < initial_users && !replaying; i++) {
+        users[i].state = USER_PENDING;
+        if (users[i].fd >= 0) {
+            fcntl(users[i].fd, F_SETFL, fcntl(users[i].fd, F_GETFL) | O_NONBLOCK);
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+            if (epoll_ctl(epfd, EPOLL_CTL_ADD, users[i].fd, &ev) < 0) {
+                perror("epoll_ctl user pipe");
+                goto out;
+            }
+            continue;
+        }
+        PipeRecord rec;
+        if (stream_head(&users[i], i, &rec)) {
+            heap_push(heap, &heap_size, (HeapEntry){ rec.timestamp, i });
+            users[i].state = USER_QUEUED;
+        } else {
+            users[i].state = USER_DONE;
+            total_active--;
+        }
+        pending--;
+    }
+
+    /* (G) Removal notices from the moderator arrive on this group's control FIFO. */
+    ctl_fd = control_fifo_create(moderator_key, group_index);
+    if (ctl_fd < 0) {
+        perror("control fifo");
+        goto out;
+    }
+    struct epoll_event rev = { .events = EPOLLIN, .data.u32 = REMOVAL_TAG };
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, ctl_fd, &rev) < 0) {
+        perror("epoll_ctl control fifo");
+        goto out;
+    }
+
+    struct epoll_event events[GROUP_EPOLL_EVENTS];
+    Waiter waiter;              /* CHATMOD_WAIT: poll briefly before blocking when input comes fast */
+    waiter_init(&waiter);
+
+    status = 0;
+    if (replaying) {
+        status = replay_trace(&replay, &link, &gstats, moderator_key, epfd, ctl_fd, &record, &user_removed_count);
+    }
+
+    while (!replaying && total_active >= 2 && status == 0) {
+        uint64_t now = stats_now_ns();
+        group_stats_tick(&gstats, &link, moderator_key, now);
+        if (batch_timeout_ms(&link, now) == 0) batch_flush(&link);
+
+        /* If we have fewer than 2 active users, the loop ends and the group terminates.
+           Only block when the merge is actually waiting for input (or for credits),
+           and no longer than the pending batch can wait. */
+        int timeout = batch_timeout_ms(&link, now);
+        if (pending == 0 && heap_size > 0) {
+            int backoff = (int)link.flow.backoff_ms;
+            if (link.flow.credits || !backoff) timeout = 0;
+            else if (timeout < 0 || backoff < timeout) timeout = backoff;
+        }
+        int nev = waiter_epoll(&waiter, epfd, events, GROUP_EPOLL_EVENTS, timeout);
+        if (nev < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int e = 0; e < nev; e++) {
+            uint32_t tag = events[e].data.u32;
+
+            if (tag == REMOVAL_TAG) {
+                /* If removeUser == 1, remove that user from group. Its heap entry (if any)
+                   is dropped lazily when it reaches the top. */
+                ModMessage m;
+                while (read(ctl_fd, &m, sizeof(m)) == sizeof(m)) {
+                    int uid = m.user_id;
+                    if (m.removeUser == 1 && m.group_id == group_index && uid >= 0 && uid < initial_users && users[uid].state != USER_DONE) {
+                        if (users[uid].state == USER_PENDING) pending--;
+                        stream_close(&users[uid], epfd);
+                        users[uid].state = USER_DONE;
+                        total_active--;
+                        user_removed_count++;
+                        counters.removed++;
+                    }
+                }
+                continue;
+            }
+
+            int i = (int)tag;
+            UserStream *us = &users[i];
+            if (us->state == USER_DONE || us->eof) continue;
+
+            ssize_t r = ring_fill(us->ring, us->fd);
+            if (r > 0) {
+                counters.bytes_read += (uint64_t)r;
+                counters.reads++;
+            }
+            else if (r == 0) {
+                /* Pipe closed -> user done once its buffered records are merged. */
+                us->eof = 1;
+                stream_close(us, epfd);
+            }
+            else if (r < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("read from user pipe");
+            }
+
+            if (us->fd >= 0 && us->ring->tail - us->ring->head == PIPE_RING_SIZE && !us->paused) {
+                struct epoll_event ev = { .events = 0, .data.u32 = (uint32_t)i };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, us->fd, &ev);
+                us->paused = 1;
+                counters.pauses++;
+            }
+
+            if (us->state == USER_PENDING) {
+                PipeRecord rec;
+                if (stream_head(us, i, &rec)) {
+                    heap_push(heap, &heap_size, (HeapEntry){ rec.timestamp, i });
+                    us->state = USER_QUEUED;
+                    pending--;
+                }
+                else if (us->eof) {
+                    if (us->ring && us->ring->tail != us->ring->head) {
+                        fprintf(stderr, "Warning: user %d closed its pipe mid-record\n", i);
+                    }
+                    us->state = USER_DONE;
+                    total_active--;
+                    pending--;
+                }
+            }
+        }
+
+        /* Forward in timestamp order while every active user has a head record. */
+        for (int sent = 0; sent < MERGE_BATCH && pending == 0 && heap_size > 0 && total_active >= 2; ) {
+            if (!link.flow.credits && !group_flow_grant(&link, gstats.header)) break;
+            HeapEntry top = heap_pop(heap, &heap_size);
+            int i = top.user;
+            UserStream *us = &users[i];
+            if (us->state != USER_QUEUED) continue; // removed while queued
+
+            /* Piped text is popped straight into the outgoing record; mapped text is
+               copied into it once by forward_chat(). */
+            PipeRecord rec;
+            Message *out = chat_slot(&link);
+            const char *msgText;
+            if (!stream_take(us, i, &rec, &msgText, out->mtext)) continue;
+            group_record(&record, &rec, msgText);
+            if (forward_chat(&link, out, &rec, msgText) < 0) {
+                status = EXIT_FAILURE;
+                break;
+            }
+            link.flow.credits--;
+            sent++;
+
+            if (us->paused) {
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t)i };
+                epoll_ctl(epfd, EPOLL_CTL_MOD, us->fd, &ev);
+                us->paused = 0;
+            }
+            if (stream_head(us, i, &rec)) {
+                heap_push(heap, &heap_size, (HeapEntry){ rec.timestamp, i });
+            }
+            else if (us->eof) {
+                us->state = USER_DONE;
+                total_active--;
+            }
+            else {
+                us->state = USER_PENDING;
+                pending++;
+            }
+        }
+    }
+
+out:
+    /* Reached on success and on failure alike; only what was acquired is released. */
+    for (int i = 0; users && i < initial_users; i++) {
+        stream_close(&users[i], epfd);
+        stream_free(&users[i]);
+    }
+    if (epfd >= 0) close(epfd);
+    if (ctl_fd >= 0) {
+        close(ctl_fd);
+        control_fifo_remove(moderator_key, group_index);
+    }
+    free(users);
+    free(heap);
+    free(user_files);
+    if (replaying) trace_close(&replay);
+    if (registered) batch_flush(&link);
+    free(link.batch);
+    if (record && trace_finish(record) < 0) perror("finishing CHATMOD_TRACE_RECORD");
+
+    if (!registered) {
+        free(user_pids);
+        return status;
+    }
+    if (!gstats.header) gstats.header = group_stats_attach(moderator_key, group_index);
+    if (gstats.header) {
+        if (gstats.counted_live) atomic_fetch_sub(&gstats.header->live_groups, 1);
+        counters.done = 1;
+        group_stats_publish(gstats.header, &link);
+        stats_detach(gstats.header);
+    }
+
+    /* ========== GROUP TERMINATION (H) ========== */
+    /* (I) mtype = 3 to validation */
+    Message termMsg;
+    termMsg.mtype = 3;
+    termMsg.timestamp = 0;
+    termMsg.user = user_removed_count; // per requirement: # users removed due to violations
+    termMsg.mtext[0] = '\0';
+    termMsg.modifyingGroup = group_index;
+
+    msgsnd(link.val_msqid, &termMsg, sizeof(termMsg) - sizeof(termMsg.mtype), 0);
+
+    /* Cleanup: wait for any user processes still running, if they haven't exited. */
+    for (int i = 0; user_pids && i < initial_users; i++) {
+        if (user_pids[i] > 0) {
+            waitpid(user_pids[i], NULL, 0);
+        }
+    }
+    free(user_pids);
+
+    /* Optionally notify the app if needed. Some designs do:
+       AppMessage finishMsg;
+       finishMsg.mtype = 999; // or group_index + 1000, etc.
+       finishMsg.group_id = group_index;
+       strcpy(finishMsg.text, "DONE");
+       msgsnd(app_msqid, &finishMsg, sizeof(finishMsg)-sizeof(finishMsg.mtype), 0);
+    */
+
+    return status;
+}
+
+#endif /* GROUP_H */
@@ -0,0 +1,103 @@
+/***************************************************
+ * latency.h
+ *
+ * End-to-end latency bookkeeping. Users stamp each message with a 32-bit
+ * CLOCK_MONOTONIC microsecond count when they write it; the moderator takes
+ * the difference once it has a verdict and drops it into a log-linear
+ * histogram (16 sub-buckets per power of two, so any reported percentile is
+ * within 1/16 of the true value). CLOCK_MONOTONIC is shared by every process
+ * on the host, and the 32-bit stamp only wraps after about 71 minutes, which
+ * unsigned subtraction absorbs.
+ ***************************************************/
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1u << LAT_SUB_BITS)
+#define LAT_BUCKETS ((32 - LAT_SUB_BITS + 1) * LAT_SUB)
+#define LAT_MAGIC 0x4c415431u   /* "LAT1" */
+
+typedef struct {
+    uint64_t count;
+    uint64_t buckets[LAT_BUCKETS];
+} LatencyHist;
+
+/* Stamp for a message being written now. Never 0, which means "not stamped". */
+static inline uint32_t lat_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint32_t us = (uint32_t)((uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u);
+    return us ? us : 1;
+}
+
+static inline unsigned lat_bucket(uint32_t us) {
+    if (us < LAT_SUB) return us;
+    unsigned e = 31 - (unsigned)__builtin_clz(us);
+    return (e - LAT_SUB_BITS + 1) * LAT_SUB + ((us >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
+}
+
+/* Largest value that falls into bucket b. */
+static inline uint64_t lat_bucket_max(unsigned b) {
+    if (b < LAT_SUB) return b;
+    unsigned e = b / LAT_SUB + LAT_SUB_BITS - 1;
+    uint64_t base = ((uint64_t)LAT_SUB + b % LAT_SUB) << (e - LAT_SUB_BITS);
+    return base + (1ull << (e - LAT_SUB_BITS)) - 1;
+}
+
+/* Add one sample, in whatever unit the histogram is kept in. */
+static inline void lat_add(LatencyHist *h, uint32_t value) {
+    h->buckets[lat_bucket(value)]++;
+    h->count++;
+}
+
+/* Record the latency of a message stamped `sent_us`; unstamped messages are ignored. */
+static inline void lat_record(LatencyHist *h, uint32_t sent_us) {
+    if (!sent_us) return;
+    lat_add(h, lat_now_us() - sent_us);
+}
+
+static inline void lat_merge(LatencyHist *into, const LatencyHist *from) {
+    into->count += from->count;
+    for (unsigned b = 0; b < LAT_BUCKETS; b++) into->buckets[b] += from->buckets[b];
+}
+
+/* Value at quantile q in [0, 1]; 0 for an empty histogram. */
+static inline uint64_t lat_quantile(const LatencyHist *h, double q) {
+    if (h->count == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)(h->count - 1)) + 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < LAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank) return lat_bucket_max(b);
+    }
+    return lat_bucket_max(LAT_BUCKETS - 1);
+}
+
+/* Raw dump, read back by lat_load(). Returns 0 on success, -1 on error. */
+static inline int lat_save(const LatencyHist *h, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+    uint32_t magic = LAT_MAGIC;
+    int ok = fwrite(&magic, sizeof(magic), 1, f) == 1 && fwrite(h, sizeof(*h), 1, f) == 1;
+    return (fclose(f) == 0 && ok) ? 0 : -1;
+}
+
+/* On error *h is left empty, so it can still be printed. */
+static inline int lat_load(LatencyHist *h, const char *path) {
+    memset(h, 0, sizeof(*h));
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    uint32_t magic = 0;
+    int ok = fread(&magic, sizeof(magic), 1, f) == 1 && magic == LAT_MAGIC &&
+             fread(h, sizeof(*h), 1, f) == 1;
+    fclose(f);
+    if (!ok) memset(h, 0, sizeof(*h));
+    return ok ? 0 : -1;
+}
+
+#endif /* LATENCY_H */
@@ -0,0 +1,143 @@
+/***************************************************
+ * lz.h
+ *
+ * A small LZ77 block compressor for trace files (trace.h). The format follows
+ * LZ4's: a block is a run of sequences, each a token byte (high nibble: literal
+ * count, low nibble: match length - LZ_MIN_MATCH; 15 means more length bytes
+ * follow, each adding up to 255), the literals, then a two-byte little-endian
+ * back offset and the match length bytes. The last sequence carries literals
+ * only and ends the block.
+ *
+ * Chat text repeats a lot within a block (spam, greetings, user ids in the
+ * record headers), which is all this has to catch; one hash probe per position
+ * keeps it fast enough to run on the recording group's own thread.
+ ***************************************************/
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 13
+
+static inline uint32_t lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length bytes beyond a nibble of 15. Returns the new end, NULL if out of room. */
+static inline uint8_t *lz_put_length(uint8_t *op, const uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* One sequence: `nlit` literals, then a match of `mlen` bytes at `offset` back
+   (mlen 0: none, this is the last sequence). Returns the new end, NULL if out of room. */
+static inline uint8_t *lz_put_sequence(uint8_t *op, const uint8_t *oend, const uint8_t *lit, size_t nlit,
+                                       size_t mlen, uint32_t offset) {
+    if (op >= oend) return NULL;
+    size_t ml = mlen ? mlen - LZ_MIN_MATCH : 0;
+    uint8_t *token = op++;
+    *token = (uint8_t)(((nlit < 15 ? nlit : 15) << 4) | (ml < 15 ? ml : 15));
+    if (nlit >= 15 && !(op = lz_put_length(op, oend, nlit - 15))) return NULL;
+    if ((size_t)(oend - op) < nlit) return NULL;
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen) return op;
+    if (oend - op < 2) return NULL;
+    op[0] = (uint8_t)offset;
+    op[1] = (uint8_t)(offset >> 8);
+    op += 2;
+    if (ml >= 15 && !(op = lz_put_length(op, oend, ml - 15))) return NULL;
+    return op;
+}
+
+/* Compress src[0..n) into dst. Returns the compressed size, or 0 if it would
+   not fit in `cap` bytes (store the block uncompressed then). */
+static inline size_t lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    uint32_t table[1u << LZ_HASH_BITS];   /* position + 1 of the last 4 bytes with this hash */
+    memset(table, 0, sizeof(table));
+    const uint8_t *ip = src, *anchor = src, *end = src + n;
+    uint8_t *op = dst;
+    const uint8_t *oend = dst + cap;
+
+    while (end - ip >= LZ_MIN_MATCH) {
+        uint32_t v = lz_read32(ip);
+        uint32_t h = lz_hash(v);
+        uint32_t cand = table[h];
+        table[h] = (uint32_t)(ip - src) + 1;
+        if (cand) {
+            const uint8_t *m = src + cand - 1;
+            uint32_t offset = (uint32_t)(ip - m);
+            if (offset <= LZ_MAX_OFFSET && lz_read32(m) == v) {
+                size_t len = LZ_MIN_MATCH;
+                while (ip + len < end && ip[len] == m[len]) len++;
+                op = lz_put_sequence(op, oend, anchor, (size_t)(ip - anchor), len, offset);
+                if (!op) return 0;
+                ip += len;
+                anchor = ip;
+                continue;
+            }
+        }
+        ip++;
+    }
+    op = lz_put_sequence(op, oend, anchor, (size_t)(end - anchor), 0, 0);
+    return op ? (size_t)(op - dst) : 0;
+}
+
+/* Length bytes beyond a nibble of 15. Returns 0, or -1 if the input ends first. */
+static inline int lz_get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decompress src[0..n) into dst. Returns the decompressed size, or -1 if the
+   block is malformed or would not fit in `cap` bytes. */
+static inline long lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && lz_get_length(&ip, iend, &nlit) < 0) return -1;
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend) break;   /* the last sequence has no match */
+
+        if (iend - ip < 2) return -1;
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && lz_get_length(&ip, iend, &mlen) < 0) return -1;
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || (size_t)(oend - op) < mlen) return -1;
+        /* Byte by byte: the match may overlap what it is producing. */
+        const uint8_t *m = op - offset;
+        for (size_t i = 0; i < mlen; i++) op[i] = m[i];
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+#endif /* LZ_H */
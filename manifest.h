@@ -0,0 +1,232 @@
+/***************************************************
+ * manifest.h
+ *
+ * A testcase compiled into one read-only file, `testcase_<N>/manifest.bin`
+ * (built by compile.out): the keys and threshold from input.txt, every
+ * group's user file list, and the automaton for filtered_words.txt, already
+ * built. app.out, groups.out and the moderator each map it with one open()
+ * instead of parsing input.txt, every group file and the word list again, so
+ * startup does not grow with the number of groups.
+ *
+ *   ManifestHeader
+ *   ManifestGroup[ngroups]    user file names are users[first .. first + nusers)
+ *   uint32_t users[nusers]    offsets into strings
+ *   char strings[]            NUL-terminated, relative to the testcase directory
+ *   matcher arrays            delta, word, link, tok, tok_text
+ *
+ * Sections are 64-byte aligned. The manifest is for the host that built it
+ * (native byte order, this build's Matcher layout). It records the size and
+ * mtime of input.txt and filtered_words.txt and is ignored once either
+ * changes; group files are not checked, so recompile after editing them.
+ ***************************************************/
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "matcher.h"
+
+#define MANIFEST_MAGIC 0x434d4631u     /* "CMF1" */
+#define MANIFEST_ALIGN 64
+
+typedef struct {
+    uint64_t off;                      /* from the start of the file */
+    uint64_t len;                      /* bytes */
+} ManifestSection;
+
+typedef struct {
+    uint32_t path;                     /* group file name, offset into strings */
+    uint32_t first;                    /* first entry in users */
+    uint32_t nusers;
+} ManifestGroup;
+
+typedef struct {
+    int64_t size;
+    int64_t mtime_ns;
+} ManifestSource;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t matcher_size;             /* sizeof(Matcher) of the build that wrote it */
+    int32_t ngroups;
+    int32_t validation_key;
+    int32_t app_key;
+    int32_t moderator_key;
+    int32_t violation_threshold;
+    uint32_t nusers;
+    ManifestSource input, words;       /* input.txt and filtered_words.txt when compiled */
+    ManifestSection groups, users, strings;
+    ManifestSection delta, word, link, tok, tok_text;
+    Matcher matcher;                   /* scalars and tables; its pointers are not used */
+} ManifestHeader;
+
+typedef struct {
+    const ManifestHeader *h;           /* NULL: no manifest */
+    size_t size;
+} Manifest;
+
+static inline void manifest_source_of(const struct stat *st, ManifestSource *src) {
+    src->size = (int64_t)st->st_size;
+    src->mtime_ns = (int64_t)st->st_mtim.tv_sec * 1000000000ll + st->st_mtim.tv_nsec;
+}
+
+/* 0 if `path` is still the file a source was recorded from. */
+static inline int manifest_check_source(const char *path, const ManifestSource *src) {
+    struct stat st;
+    ManifestSource now;
+    if (stat(path, &st) < 0) return -1;
+    manifest_source_of(&st, &now);
+    return now.size == src->size && now.mtime_ns == src->mtime_ns ? 0 : -1;
+}
+
+static inline int manifest_section_ok(const ManifestSection *s, size_t size) {
+    return s->off <= size && s->len <= size - s->off && s->off % MANIFEST_ALIGN == 0;
+}
+
+static inline void manifest_close(Manifest *m) {
+    if (m->h) munmap((void *)m->h, m->size);
+    m->h = NULL;
+    m->size = 0;
+}
+
+/* Every index the readers follow stays inside the mapping: strings end in a NUL,
+   byte classes name columns, transitions and links name states, word ids name
+   words, and each token's text lies within tok_text. Section sizes must already
+   have been checked. */
+static inline int manifest_contents_ok(const Manifest *m) {
+    const ManifestHeader *h = m->h;
+    const Matcher *mt = &h->matcher;
+    const char *strings = (const char *)m->h + h->strings.off;
+    if (strings[h->strings.len - 1] != '\0' || mt->nwords < 0) return 0;
+    for (int c = 0; c < 256; c++) {
+        if (mt->cls[c] >= mt->nclasses) return 0;
+    }
+
+    const int32_t *delta = (const int32_t *)((const char *)h + h->delta.off);
+    const int32_t *word = (const int32_t *)((const char *)h + h->word.off);
+    const int32_t *link = (const int32_t *)((const char *)h + h->link.off);
+    uint64_t ndelta = h->delta.len / sizeof(int32_t);
+    for (uint64_t i = 0; i < ndelta; i++) {
+        if (delta[i] < 0 || delta[i] >= mt->nstates) return 0;
+    }
+    for (int32_t i = 0; i < mt->nstates; i++) {
+        if (word[i] < -1 || word[i] >= mt->nwords) return 0;
+        if (link[i] < -1 || link[i] >= mt->nstates) return 0;
+    }
+    const MatcherToken *tok = (const MatcherToken *)((const char *)h + h->tok.off);
+    for (uint64_t i = 0; i <= mt->tok_mask; i++) {
+        if (!tok[i].hash) continue;
+        if ((uint64_t)tok[i].off + tok[i].len > h->tok_text.len) return 0;
+        if (tok[i].word < -1 || tok[i].word >= mt->nwords) return 0;
+    }
+    return 1;
+}
+
+/* Map `<folder>/manifest.bin`. Returns 0, or -1 with errno ENOENT if there is
+   none, ESTALE if its sources have changed since, EINVAL if it is not usable. */
+static inline int manifest_open(Manifest *m, const char *folder) {
+    char path[256];
+    m->h = NULL;
+    m->size = 0;
+    snprintf(path, sizeof(path), "%s/manifest.bin", folder);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ManifestHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return -1;
+    m->h = p;
+    m->size = (size_t)st.st_size;
+
+    const ManifestHeader *h = m->h;
+    const ManifestSection *sections[] = { &h->groups, &h->users, &h->strings, &h->delta,
+                                          &h->word, &h->link, &h->tok, &h->tok_text };
+    int ok = h->magic == MANIFEST_MAGIC && h->matcher_size == sizeof(Matcher) && h->ngroups >= 0 &&
+             h->groups.len == (uint64_t)h->ngroups * sizeof(ManifestGroup) &&
+             h->users.len == (uint64_t)h->nusers * sizeof(uint32_t) && h->strings.len > 0 &&
+             h->matcher.nstates > 0 && h->matcher.nclasses > 0 && h->matcher.nclasses <= 256 &&
+             h->delta.len == (uint64_t)h->matcher.nstates * h->matcher.nclasses * sizeof(int32_t) &&
+             h->word.len == (uint64_t)h->matcher.nstates * sizeof(int32_t) &&
+             h->link.len == h->word.len &&
+             h->tok.len == ((uint64_t)h->matcher.tok_mask + 1) * sizeof(MatcherToken);
+    for (size_t i = 0; ok && i < sizeof(sections) / sizeof(sections[0]); i++) {
+        ok = manifest_section_ok(sections[i], m->size);
+    }
+    ok = ok && manifest_contents_ok(m);
+    if (!ok) {
+        manifest_close(m);
+        errno = EINVAL;
+        return -1;
+    }
+
+    char source[256];
+    snprintf(source, sizeof(source), "%s/input.txt", folder);
+    int fresh = manifest_check_source(source, &h->input) == 0;
+    snprintf(source, sizeof(source), "%s/filtered_words.txt", folder);
+    fresh = fresh && manifest_check_source(source, &h->words) == 0;
+    if (!fresh) {
+        manifest_close(m);
+        errno = ESTALE;
+        return -1;
+    }
+    return 0;
+}
+
+/* Map the manifest if it is there and current; say why not if it is there but unusable. */
+static inline int manifest_try_open(Manifest *m, const char *folder, const char *who) {
+    if (manifest_open(m, folder) == 0) return 0;
+    if (errno != ENOENT) {
+        fprintf(stderr, "%s: not using %s/manifest.bin (%s); reading the text files\n", who, folder,
+                errno == ESTALE ? "out of date, run compile.out again" : strerror(errno));
+    }
+    return -1;
+}
+
+static inline const void *manifest_at(const Manifest *m, const ManifestSection *s) {
+    return (const char *)m->h + s->off;
+}
+
+/* A string from the manifest, or "" if the offset is out of range. */
+static inline const char *manifest_string(const Manifest *m, uint32_t off) {
+    if (off >= m->h->strings.len) return "";
+    return (const char *)manifest_at(m, &m->h->strings) + off;
+}
+
+/* Group g's entry, NULL if out of range. */
+static inline const ManifestGroup *manifest_group(const Manifest *m, int g) {
+    if (g < 0 || g >= m->h->ngroups) return NULL;
+    const ManifestGroup *mg = (const ManifestGroup *)manifest_at(m, &m->h->groups) + g;
+    if (mg->first > m->h->nusers || mg->nusers > m->h->nusers - mg->first) return NULL;
+    return mg;
+}
+
+/* The name of user i's file in group `mg`, relative to the testcase directory. */
+static inline const char *manifest_user_file(const Manifest *m, const ManifestGroup *mg, uint32_t i) {
+    const uint32_t *users = manifest_at(m, &m->h->users);
+    return manifest_string(m, users[mg->first + i]);
+}
+
+/* The prebuilt automaton, as a matcher whose arrays stay in the mapping. */
+static inline void manifest_matcher(const Manifest *m, Matcher *out) {
+    *out = m->h->matcher;
+    out->delta = (int32_t *)manifest_at(m, &m->h->delta);
+    out->word = (int32_t *)manifest_at(m, &m->h->word);
+    out->link = (int32_t *)manifest_at(m, &m->h->link);
+    out->tok = (MatcherToken *)manifest_at(m, &m->h->tok);
+    out->tok_text = (char *)manifest_at(m, &m->h->tok_text);
+    out->borrowed = 1;
+}
+
+#endif /* MANIFEST_H */
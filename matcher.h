@@ -0,0 +1,484 @@
+/***************************************************
+ * matcher.h
+ *
+ * Aho-Corasick automaton over the filtered words. Built once, then every
+ * message is scanned in a single pass no matter how many words there are.
+ *
+ * Case folding lives in the byte -> class map: 'A' and 'a' map to the same
+ * column of the transition table, and bytes that appear in no word share
+ * class 0, which always leads back to the root. The table is complete (no
+ * failure links are followed while scanning), and everything is stored as
+ * flat arrays of indices so it can be written out and mapped back as is.
+ *
+ * Most messages contain no filtered word at all, so matcher_prefilter()
+ * runs first: it folds case a vector at a time and checks every position
+ * against the set of bytes that can start a word, then the (byte, next byte)
+ * pair against a bitmap of word prefixes. Only messages that survive go
+ * through the automaton. The SIMD variant is picked once with CPUID.
+ *
+ * In whole-word mode (MATCH_WORD) a filtered word only counts when it is a
+ * whole token of the message: a maximal run of ASCII letters and digits
+ * (bytes >= 0x80 also belong to tokens). The message is split once, and each
+ * token is hashed as it is read and looked up in an open-addressing set of
+ * the folded words, so matching costs one probe per token. Words containing
+ * other characters can never match in this mode.
+ ***************************************************/
+#ifndef MATCHER_H
+#define MATCHER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MATCHER_X86 1
+#endif
+
+typedef enum { MATCH_SUBSTRING, MATCH_WORD } MatchMode;
+
+/* One entry of the whole-word set; hash 0 marks an empty slot. */
+typedef struct {
+    uint64_t hash;
+    uint32_t off;         /* folded word in tok_text */
+    uint16_t len;
+    int32_t  word;        /* same id the automaton uses */
+} MatcherToken;
+
+typedef struct {
+    uint8_t  cls[256];    /* byte -> column, case-folded; 0 = in no word */
+    int32_t  nclasses;
+    int32_t  nstates;
+    int32_t  nwords;      /* distinct words */
+    int32_t *delta;       /* nstates * nclasses transitions */
+    int32_t *word;        /* word id ending exactly at a state, or -1 */
+    int32_t *link;        /* nearest proper suffix state that ends a word, or -1 */
+
+    /* Prefilter over folded text. */
+    uint8_t  start[256];      /* 0: starts no word, 1: check pair, 2: a one-byte word */
+    uint8_t  nib_lo[16];      /* shufti tables: byte b can start a word only if */
+    uint8_t  nib_hi[16];      /* (nib_lo[b & 15] & nib_hi[b >> 4]) != 0 */
+    uint64_t pairs[1024];     /* bit (b0 << 8 | b1) set if some word starts with b0 b1 */
+
+    /* Whole-word mode. */
+    int32_t  mode;            /* MatchMode */
+    uint32_t tok_mask;        /* slots - 1; slots is a power of two, at most half full */
+    MatcherToken *tok;
+    char    *tok_text;
+
+    uint32_t generation;      /* set by whoever publishes it; tells verdict caches apart */
+    int32_t  borrowed;        /* arrays belong to someone else (a mapped manifest) */
+} Matcher;
+
+/* Scratch size for matcher_prefilter(): room for the text plus one padded vector. */
+#define MATCHER_FOLD_PAD 32
+
+static inline void matcher_free(Matcher *m) {
+    if (m->borrowed) {
+        memset(m, 0, sizeof(*m));
+        return;
+    }
+    free(m->delta);
+    free(m->word);
+    free(m->link);
+    free(m->tok);
+    free(m->tok_text);
+    memset(m, 0, sizeof(*m));
+}
+
+/* Grow the per-state arrays so that state index `need` is valid. */
+static inline int matcher_reserve(Matcher *m, int32_t *cap, int32_t need) {
+    if (need < *cap) return 0;
+    int32_t ncap = *cap ? *cap * 2 : 256;
+    while (ncap <= need) ncap *= 2;
+    int32_t *d = realloc(m->delta, (size_t)ncap * m->nclasses * sizeof(int32_t));
+    if (!d) return -1;
+    m->delta = d;
+    int32_t *w = realloc(m->word, (size_t)ncap * sizeof(int32_t));
+    if (!w) return -1;
+    m->word = w;
+    int32_t *l = realloc(m->link, (size_t)ncap * sizeof(int32_t));
+    if (!l) return -1;
+    m->link = l;
+    *cap = ncap;
+    return 0;
+}
+
+/* Build the automaton from `count` words. Returns 0 on success, -1 on allocation failure. */
+static inline int matcher_build(Matcher *m, char *const *words, int count) {
+    memset(m, 0, sizeof(*m));
+
+    /* Columns: one per distinct (lowercased) byte used by any word. */
+    int seen_byte[256] = {0};
+    for (int i = 0; i < count; i++) {
+        for (const unsigned char *p = (const unsigned char *)words[i]; *p; p++) {
+            seen_byte[tolower(*p)] = 1;
+        }
+    }
+    m->nclasses = 1;
+    uint8_t lower_cls[256] = {0};
+    for (int c = 0; c < 256; c++) {
+        if (seen_byte[c]) lower_cls[c] = (uint8_t)m->nclasses++;
+    }
+    for (int c = 0; c < 256; c++) {
+        m->cls[c] = lower_cls[tolower(c)];
+    }
+
+    /* Prefilter tables, on lowercased bytes. The shufti bucket is the high nibble mod 8,
+       which is exact for ASCII and a safe superset otherwise. */
+    for (int i = 0; i < count; i++) {
+        const unsigned char *p = (const unsigned char *)words[i];
+        if (!p[0]) continue;
+        int b0 = tolower(p[0]);
+        if (!p[1]) {
+            m->start[b0] = 2;
+        } else {
+            if (m->start[b0] == 0) m->start[b0] = 1;
+            int key = b0 << 8 | tolower(p[1]);
+            m->pairs[key >> 6] |= 1ULL << (key & 63);
+        }
+        m->nib_lo[b0 & 15] |= (uint8_t)(1u << ((b0 >> 4) & 7));
+        m->nib_hi[b0 >> 4] |= (uint8_t)(1u << ((b0 >> 4) & 7));
+    }
+
+    /* Trie. -1 marks a missing edge until the BFS below fills it in. */
+    int32_t cap = 0;
+    if (matcher_reserve(m, &cap, 0) < 0) return -1;
+    m->nstates = 1;
+    for (int c = 0; c < m->nclasses; c++) m->delta[c] = -1;
+    m->word[0] = -1;
+
+    for (int i = 0; i < count; i++) {
+        const unsigned char *p = (const unsigned char *)words[i];
+        if (!*p) continue;
+        int32_t s = 0;
+        for (; *p; p++) {
+            int32_t *edge = &m->delta[(size_t)s * m->nclasses + m->cls[*p]];
+            if (*edge < 0) {
+                if (matcher_reserve(m, &cap, m->nstates) < 0) return -1;
+                edge = &m->delta[(size_t)s * m->nclasses + m->cls[*p]];
+                int32_t t = m->nstates++;
+                for (int c = 0; c < m->nclasses; c++) m->delta[(size_t)t * m->nclasses + c] = -1;
+                m->word[t] = -1;
+                *edge = t;
+            }
+            s = *edge;
+        }
+        if (m->word[s] < 0) m->word[s] = m->nwords++;  /* duplicates count once */
+    }
+
+    /* BFS: compute failure states and turn the trie into a complete DFA. */
+    int32_t *fail = malloc((size_t)m->nstates * sizeof(int32_t));
+    int32_t *queue = malloc((size_t)m->nstates * sizeof(int32_t));
+    if (!fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    int32_t qh = 0, qt = 0;
+    fail[0] = 0;
+    m->link[0] = -1;
+    for (int c = 0; c < m->nclasses; c++) {
+        int32_t t = m->delta[c];
+        if (c == 0 || t < 0) {
+            m->delta[c] = 0;
+        } else {
+            fail[t] = 0;
+            m->link[t] = -1;
+            queue[qt++] = t;
+        }
+    }
+    while (qh < qt) {
+        int32_t s = queue[qh++];
+        int32_t *row = &m->delta[(size_t)s * m->nclasses];
+        const int32_t *frow = &m->delta[(size_t)fail[s] * m->nclasses];
+        for (int c = 0; c < m->nclasses; c++) {
+            int32_t t = row[c];
+            if (c == 0) {
+                row[c] = 0;
+            } else if (t < 0) {
+                row[c] = frow[c];
+            } else {
+                int32_t f = frow[c];
+                fail[t] = f;
+                m->link[t] = m->word[f] >= 0 ? f : m->link[f];
+                queue[qt++] = t;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    return 0;
+}
+
+static inline int matcher_token_byte(unsigned char c) {
+    return c >= 0x80 || isalnum(c);
+}
+
+/* FNV-1a step over an already folded byte. */
+static inline uint64_t matcher_token_hash(uint64_t h, unsigned char c) {
+    return (h ^ c) * 0x100000001b3ull;
+}
+
+#define MATCHER_TOKEN_SEED 0xcbf29ce484222325ull
+
+/* Whole-word set over the words of an already built automaton. Returns 0 on
+   success, -1 on allocation failure. */
+static inline int matcher_build_tokens(Matcher *m, char *const *words, int count) {
+    uint32_t slots = 16;
+    while (slots < (uint32_t)count * 2) slots *= 2;
+    size_t text_bytes = 1;
+    for (int i = 0; i < count; i++) text_bytes += strlen(words[i]);
+    m->tok = calloc(slots, sizeof(MatcherToken));
+    m->tok_text = malloc(text_bytes);
+    if (!m->tok || !m->tok_text) return -1;
+    m->tok_mask = slots - 1;
+
+    uint32_t used = 0;
+    for (int i = 0; i < count; i++) {
+        const unsigned char *p = (const unsigned char *)words[i];
+        size_t len = strlen(words[i]);
+        if (!len || len > UINT16_MAX) continue;
+        /* The word's id is where its own trie path ends. */
+        int32_t s = 0;
+        uint64_t h = MATCHER_TOKEN_SEED;
+        char *folded = m->tok_text + used;
+        for (size_t k = 0; k < len; k++) {
+            s = m->delta[(size_t)s * m->nclasses + m->cls[p[k]]];
+            folded[k] = (char)tolower(p[k]);
+            h = matcher_token_hash(h, (unsigned char)folded[k]);
+        }
+        if (!h) h = 1;
+        uint32_t at = (uint32_t)h & m->tok_mask;
+        int dup = 0;
+        while (m->tok[at].hash) {
+            const MatcherToken *t = &m->tok[at];
+            if (t->hash == h && t->len == len && !memcmp(m->tok_text + t->off, folded, len)) {
+                dup = 1;
+                break;
+            }
+            at = (at + 1) & m->tok_mask;
+        }
+        if (dup) continue;
+        m->tok[at] = (MatcherToken){ h, used, (uint16_t)len, m->word[s] };
+        used += (uint32_t)len;
+    }
+    return 0;
+}
+
+/* Read whitespace-separated words from a file and build the automaton, plus
+   the whole-word set when `mode` is MATCH_WORD. */
+static inline int matcher_load(Matcher *m, const char *path, MatchMode mode) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    char **words = NULL;
+    int count = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    int rc = 0;
+    while (getline(&line, &line_cap, f) != -1) {
+        char *save = NULL;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                char **nw = realloc(words, cap * sizeof(char *));
+                if (!nw) { rc = -1; goto out; }
+                words = nw;
+            }
+            if (!(words[count] = strdup(tok))) { rc = -1; goto out; }
+            count++;
+        }
+    }
+    rc = matcher_build(m, words, count);
+    if (rc == 0 && mode == MATCH_WORD) rc = matcher_build_tokens(m, words, count);
+    m->mode = mode;
+
+out:
+    for (int i = 0; i < count; i++) free(words[i]);
+    free(words);
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+/* Whole-word mode: is folded token text[0..len) with hash h a filtered word? */
+static inline int32_t matcher_token_word(const Matcher *m, const char *text, size_t len, uint64_t h) {
+    if (!h) h = 1;
+    for (uint32_t at = (uint32_t)h & m->tok_mask; m->tok[at].hash; at = (at + 1) & m->tok_mask) {
+        const MatcherToken *t = &m->tok[at];
+        if (t->hash == h && t->len == len && !memcmp(m->tok_text + t->off, text, len)) return t->word;
+    }
+    return -1;
+}
+
+static inline int matcher_count_tokens(const Matcher *m, const char *text, size_t len,
+                                       uint32_t *seen, uint32_t st) {
+    int found = 0;
+    size_t start = 0;
+    uint64_t h = MATCHER_TOKEN_SEED;
+    for (size_t i = 0; i <= len; i++) {
+        unsigned char c = i < len ? (unsigned char)text[i] : 0;
+        if (i < len && matcher_token_byte(c)) {
+            h = matcher_token_hash(h, c);
+            continue;
+        }
+        if (i > start) {
+            int32_t w = matcher_token_word(m, text + start, i - start, h);
+            if (w >= 0 && seen[w] != st) {
+                seen[w] = st;
+                found++;
+            }
+        }
+        start = i + 1;
+        h = MATCHER_TOKEN_SEED;
+    }
+    return found;
+}
+
+/* Count how many distinct words occur in text[0..len), which must already be
+   folded (matcher_prefilter() does that) in whole-word mode.
+   `seen` has one slot per word and `*stamp` is bumped once per call, so it
+   never has to be cleared between messages. */
+static inline int matcher_count(const Matcher *m, const char *text, size_t len,
+                                       uint32_t *seen, uint32_t *stamp) {
+    if (++*stamp == 0) {
+        memset(seen, 0, (size_t)m->nwords * sizeof(uint32_t));
+        *stamp = 1;
+    }
+    uint32_t st = *stamp;
+    if (m->mode == MATCH_WORD) return matcher_count_tokens(m, text, len, seen, st);
+    int found = 0;
+    int32_t s = 0;
+    for (size_t i = 0; i < len; i++) {
+        s = m->delta[(size_t)s * m->nclasses + m->cls[(unsigned char)text[i]]];
+        for (int32_t o = m->word[s] >= 0 ? s : m->link[s]; o >= 0; o = m->link[o]) {
+            int32_t w = m->word[o];
+            if (seen[w] != st) {
+                seen[w] = st;
+                found++;
+            }
+        }
+    }
+    return found;
+}
+
+/* Does folded position i start a possible match? */
+static inline int matcher_candidate(const Matcher *m, const uint8_t *f, size_t i) {
+    uint8_t kind = m->start[f[i]];
+    if (kind == 2) return 1;
+    int key = f[i] << 8 | f[i + 1];
+    return kind && ((m->pairs[key >> 6] >> (key & 63)) & 1);
+}
+
+static inline int matcher_prefilter_scalar(const Matcher *m, const char *text, size_t len, char *folded) {
+    uint8_t *f = (uint8_t *)folded;
+    for (size_t i = 0; i < len; i++) {
+        uint8_t c = (uint8_t)text[i];
+        f[i] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    }
+    f[len] = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (matcher_candidate(m, f, i)) return 1;
+    }
+    return 0;
+}
+
+#ifdef MATCHER_X86
+/* Load up to 16/32 bytes; the tail is zero-padded so nothing past len is read. */
+#define MATCHER_LOAD_TAIL(type, loadu, width)                  \
+    static inline type matcher_load_##width(const char *p, size_t n) { \
+        if (n >= width) return loadu((const type *)p);                 \
+        char tmp[width] = {0};                                         \
+        memcpy(tmp, p, n);                                             \
+        return loadu((const type *)tmp);                               \
+    }
+
+__attribute__((target("sse2")))
+MATCHER_LOAD_TAIL(__m128i, _mm_loadu_si128, 16)
+
+__attribute__((target("avx2")))
+MATCHER_LOAD_TAIL(__m256i, _mm256_loadu_si256, 32)
+
+/* SSE2: vector case folding, scalar position checks. */
+__attribute__((target("sse2")))
+static inline int matcher_prefilter_sse2(const Matcher *m, const char *text, size_t len, char *folded) {
+    const __m128i bias = _mm_set1_epi8((char)(128 - 'A'));
+    const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (size_t i = 0; i < len; i += 16) {
+        __m128i v = matcher_load_16(text + i, len - i);
+        __m128i upper = _mm_cmplt_epi8(_mm_add_epi8(v, bias), limit);
+        _mm_storeu_si128((__m128i *)(folded + i), _mm_add_epi8(v, _mm_and_si128(upper, bit)));
+    }
+    folded[len] = 0;
+    const uint8_t *f = (const uint8_t *)folded;
+    for (size_t i = 0; i < len; i++) {
+        if (matcher_candidate(m, f, i)) return 1;
+    }
+    return 0;
+}
+
+/* AVX2: fold and find candidate start bytes 32 at a time with a nibble shuffle
+   ("shufti"); only candidate positions get the pair check. */
+__attribute__((target("avx2")))
+static inline int matcher_prefilter_avx2(const Matcher *m, const char *text, size_t len, char *folded) {
+    const __m256i bias = _mm256_set1_epi8((char)(128 - 'A'));
+    const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    const __m256i low4 = _mm256_set1_epi8(0x0f);
+    const __m256i lo_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m->nib_lo));
+    const __m256i hi_tbl = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)m->nib_hi));
+    const __m256i zero = _mm256_setzero_si256();
+
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i v = matcher_load_32(text + i, len - i);
+        __m256i upper = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, bias));
+        v = _mm256_add_epi8(v, _mm256_and_si256(upper, bit));
+        _mm256_storeu_si256((__m256i *)(folded + i), v);
+    }
+    folded[len] = 0;
+
+    const uint8_t *f = (const uint8_t *)folded;
+    for (size_t i = 0; i < len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(folded + i));
+        __m256i lo = _mm256_shuffle_epi8(lo_tbl, _mm256_and_si256(v, low4));
+        __m256i hi = _mm256_shuffle_epi8(hi_tbl, _mm256_and_si256(_mm256_srli_epi16(v, 4), low4));
+        __m256i hit = _mm256_cmpeq_epi8(_mm256_and_si256(lo, hi), zero);
+        uint32_t cand = ~(uint32_t)_mm256_movemask_epi8(hit);
+        if (len - i < 32) cand &= (1u << (len - i)) - 1;
+        while (cand) {
+            size_t pos = i + (size_t)__builtin_ctz(cand);
+            if (matcher_candidate(m, f, pos)) return 1;
+            cand &= cand - 1;
+        }
+    }
+    return 0;
+}
+#endif
+
+typedef int (*MatcherPrefilterFn)(const Matcher *, const char *, size_t, char *);
+
+static inline MatcherPrefilterFn matcher_pick_prefilter(void) {
+#ifdef MATCHER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return matcher_prefilter_avx2;
+    if (__builtin_cpu_supports("sse2")) return matcher_prefilter_sse2;
+#endif
+    return matcher_prefilter_scalar;
+}
+
+/* Fold text[0..len) into `folded` (at least len + MATCHER_FOLD_PAD bytes) and
+   return 0 if it cannot contain any word, so the automaton can be skipped. */
+static inline int matcher_prefilter(const Matcher *m, const char *text, size_t len, char *folded) {
+    static MatcherPrefilterFn impl;
+    MatcherPrefilterFn fn = __atomic_load_n(&impl, __ATOMIC_RELAXED);
+    if (!fn) {
+        fn = matcher_pick_prefilter();
+        __atomic_store_n(&impl, fn, __ATOMIC_RELAXED);
+    }
+    return fn(m, text, len, folded);
+}
+
+#endif /* MATCHER_H */
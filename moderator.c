@@ -1,6 +1,7 @@
 /***************************************************
  * moderator.c
  ***************************************************/
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,11 +10,35 @@
 #include <sys/msg.h>
 #include <unistd.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/inotify.h>
+
+#include "batch.h"
+#include "config.h"
+#include "latency.h"
+#include "manifest.h"
+#include "matcher.h"
+#include "msgpool.h"
+#include "qsbr.h"
+#include "spsc.h"
+#include "stats.h"
+#include "topology.h"
+#include "transport.h"
+#include "twheel.h"
+#include "vcache.h"
+#include "vlog.h"
+#include "vtable.h"
+#include "waiter.h"
 
-#define MAX_FILTERED 50
-#define MAX_WORD_LEN 20
-#define MAX_GROUPS 30
 #define MAX_TEXT_SIZE 256
+#define SHARD_QUEUE_SLOTS 1024   /* per-shard work queue, power of two */
+#define SHARD_DRAIN_BUDGET 64    /* messages taken from one ring before moving on */
+#define MATCH_SAMPLE_MASK 15     /* time one message in 16 for the match-time histogram */
+#define CONTROL_BATCH 128        /* removals held back per shard when batching (well under PIPE_BUF) */
+#define RELOAD_SETTLE_MS 50      /* quiet time after the last change before filtered_words.txt is reread */
 
 /* This matches the structure that group uses to send messages. */
 typedef struct {
@@ -22,6 +47,7 @@ typedef struct {
     int user;
     char mtext[MAX_TEXT_SIZE];
     int modifyingGroup;
+    uint32_t sent_us;     // when the user wrote it (latency.h), 0 if unknown
 } Message;
 
 /* For returning removal signals */
@@ -32,10 +58,498 @@ typedef struct {
     int removeUser;
 } ModMessage;
 
-/* Helper function: convert string to lowercase in-place */
-void toLowerCase(char *str) {
-    for(int i=0; str[i]; i++){
-        str[i] = tolower((unsigned char)str[i]);
+/* One worker thread. Groups are sharded by group id (g % nshards), so each
+   shard is the only writer of its groups' violation counts and needs no locks. */
+typedef struct {
+    int id;
+    SpscRing *queue;              /* handles of pooled chat messages routed to this shard */
+    Doorbell *bell;               /* rung when `queue` (or an owned shm ring) goes non-empty */
+    Doorbell local_bell;          /* backs `bell` unless the shm transport provides one */
+    SpscRing **rings;             /* shm transport: rings of the groups this shard owns */
+    int nrings;
+    VTable violations;            /* (group, user) -> count, for this shard's groups */
+    TimerWheel **windows;         /* CHATMOD_WINDOW: per owned group (g / nshards), NULL until needed */
+    TimerPool timers;             /* and the violations they will expire */
+    int *control_fds;             /* per owned group (g / nshards): control FIFO, -1 until first needed */
+    ModMessage *removals;         /* CHATMOD_BATCH: decided but not yet written */
+    int nremovals;
+    uint32_t *word_seen;          /* matcher_count() scratch */
+    uint32_t word_cap;            /* entries in word_seen; grows if a reload adds words */
+    uint32_t word_stamp;
+    VCache cache;                 /* CHATMOD_VERDICT_CACHE: text -> violations */
+    LatencyHist latency;          /* user write -> verdict */
+    GroupVerdicts *verdicts;      /* per owned group (g / nshards), for the stats segment */
+    uint64_t stats_published;     /* when, and at what `moderated` count */
+    uint64_t published_moderated;
+    uint32_t advertised_room;     /* last value stored in the stats slot's `room` */
+    Waiter waiter;                /* CHATMOD_WAIT: how an idle shard waits */
+    pthread_t tid;
+    _Alignas(SPSC_CACHELINE) ShardCounters stats;
+} Shard;
+
+/* The active matcher. Shards load it per message and never block on a reload;
+   the reload thread swaps in a new one and frees the old once every shard has
+   passed a quiescent state (see qsbr.h). */
+static _Atomic(Matcher *) matcher;
+static Qsbr matcher_qsbr;
+static MatchMode match_mode;    /* CHATMOD_MATCH: substring (default) or word */
+
+/* Chat messages from the System V queue are received straight into records of
+   this pool (owned by the dispatcher) and reach the shards by handle; each shard
+   hands them back through its own return ring. */
+static MsgPool pool;
+
+/* CHATMOD_STATE_DIR: durable violation counts, NULL when not kept. */
+static VLog *vlog;
+static _Atomic int vlog_stop;
+
+/* Read-only after startup; shared by all shards. */
+static int violation_threshold;
+static uint64_t violation_window;   /* CHATMOD_WINDOW: in timestamp units; 0 counts for a user's lifetime */
+static int mod_msqid;
+static int moderator_key;
+static int ngroups;
+static int nshards;
+static StatsHeader *stats;   /* NULL if the segment could not be created */
+static int batch_verdicts;   /* CHATMOD_BATCH > 1: write removals to each group in bulk */
+
+static void moderate(Shard *sh, const Message *msg);
+
+/* Handle up to `budget` messages from one shm ring. Returns how many were handled. */
+static int drain_ring(Shard *sh, SpscRing *ring, int budget) {
+    int done = 0;
+    Message *msg;
+    while (done < budget && (msg = spsc_front(ring))) {
+        moderate(sh, msg);
+        lat_record(&sh->latency, msg->sent_us);
+        spsc_pop(ring);
+        done++;
+    }
+    return done;
+}
+
+/* The same for the shard's queue of pooled messages; a record with mtype 0 is the
+   shutdown sentinel. */
+static int drain_queue(Shard *sh, int budget, int *stop) {
+    int done = 0;
+    MsgHandle *h;
+    while (done < budget && (h = spsc_front(sh->queue))) {
+        Message *msg = pool_record(&pool, *h);
+        if (msg->mtype == 0) {
+            *stop = 1;
+        } else {
+            moderate(sh, msg);
+            lat_record(&sh->latency, msg->sent_us);
+        }
+        pool_release(&pool, sh->id, *h);
+        spsc_pop(sh->queue);
+        done++;
+        if (*stop) break;
+    }
+    return done;
+}
+
+/* Copy this shard's counters (and its groups' verdict totals) into the stats segment. */
+static void shard_publish_stats(Shard *sh) {
+    uint64_t depth = spsc_depth(sh->queue);
+    for (int r = 0; r < sh->nrings; r++) depth += spsc_depth(sh->rings[r]);
+    sh->stats.queue_depth = depth;
+    sh->stats.idle_waits = sh->waiter.waits;
+    sh->stats.idle_blocks = sh->waiter.blocks;
+    sh->stats.cache_hits = sh->cache.hits;
+    sh->stats.cache_misses = sh->cache.misses;
+
+    ShardSlot *slot = stats_shard(stats, sh->id);
+    stats_write_begin(&slot->seq);
+    slot->updated_ns = stats_now_ns();
+    slot->c = sh->stats;
+    for (int g = sh->id; g < ngroups; g += nshards) {
+        *stats_verdicts(stats, g) = sh->verdicts[g / nshards];
+    }
+    stats_write_end(&slot->seq);
+}
+
+/* Tell groups how much more this shard's queue takes (see flow.h); written only on change. */
+static void shard_advertise_room(Shard *sh) {
+    uint32_t room = SHARD_QUEUE_SLOTS - spsc_depth(sh->queue);
+    if (room == sh->advertised_room) return;
+    atomic_store_explicit(&stats_shard(stats, sh->id)->room, room, memory_order_relaxed);
+    sh->advertised_room = room;
+}
+
+/* Anything waiting for this shard? */
+static int shard_has_work(Shard *sh) {
+    if (spsc_front(sh->queue)) return 1;
+    for (int r = 0; r < sh->nrings; r++) {
+        if (spsc_front(sh->rings[r])) return 1;
+    }
+    return 0;
+}
+
+/* SIGINT/SIGTERM stop the dispatcher. A signal that lands while it is routing rather
+   than blocked in msgrcv() would otherwise be lost, so the handler also queues a
+   group-created notice (which the moderator ignores) to wake the next msgrcv(). */
+static volatile sig_atomic_t stop_requested;
+
+static void on_shutdown_signal(int sig) {
+    (void)sig;
+    int saved = errno;
+    stop_requested = 1;
+    Message nudge = { .mtype = 1 };
+    msgsnd(mod_msqid, &nudge, sizeof(nudge) - sizeof(long), IPC_NOWAIT);
+    errno = saved;
+}
+
+/* Write `count` decisions to group g's control FIFO, opening it on first use. At most
+   CONTROL_BATCH records go at once, which is less than PIPE_BUF, so each write lands whole. */
+static void send_control(Shard *sh, int g, const ModMessage *m, int count) {
+    int *fd = &sh->control_fds[g / nshards];
+    ssize_t bytes = (ssize_t)(count * sizeof(*m));
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (*fd < 0) *fd = control_fifo_open(moderator_key, g);
+        if (*fd < 0) {
+            fprintf(stderr, "moderator: group %d is not listening for removals\n", g);
+            return;
+        }
+        if (write(*fd, m, bytes) == bytes) return;
+        /* The group went away (EPIPE) or was restarted; retry once on a fresh open. */
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+/* Write out held-back removals, one write() per group. */
+static void flush_removals(Shard *sh) {
+    ModMessage batch[CONTROL_BATCH];
+    while (sh->nremovals > 0) {
+        int g = sh->removals[0].group_id;
+        int count = 0, kept = 0;
+        for (int i = 0; i < sh->nremovals; i++) {
+            if (sh->removals[i].group_id == g) batch[count++] = sh->removals[i];
+            else sh->removals[kept++] = sh->removals[i];
+        }
+        sh->nremovals = kept;
+        send_control(sh, g, batch, count);
+    }
+}
+
+static void queue_removal(Shard *sh, const ModMessage *m) {
+    if (!batch_verdicts) {
+        send_control(sh, m->group_id, m, 1);
+        return;
+    }
+    sh->removals[sh->nremovals++] = *m;
+    if (sh->nremovals == CONTROL_BATCH) flush_removals(sh);
+}
+
+/* Windowed counts: a removed user's entry is pinned at this so that its count
+   neither expires nor crosses the threshold a second time. */
+#define WINDOW_REMOVED INT32_MAX
+
+/* A message timestamp on the (unsigned) timer wheel clock. */
+static uint64_t window_time(int timestamp) {
+    return (uint64_t)((int64_t)timestamp - INT32_MIN);
+}
+
+/* Timer wheel callback: a violation has left the window. */
+static void window_expire(void *arg, const Timer *t) {
+    Shard *sh = (Shard *)arg;
+    int32_t *count = vtable_find(&sh->violations, t->key);
+    if (!count || *count == WINDOW_REMOVED) return;
+    *count -= t->amount;
+    sh->stats.expired += (uint64_t)t->amount;
+    if (*count <= 0) vtable_remove(&sh->violations, t->key);
+}
+
+/* Schedule `amount` violations by (g, u) at `timestamp` to leave the window. Returns 1
+   if they count (0 if they are older than the window already), -1 if out of memory. */
+static int window_add(Shard *sh, int g, int u, int timestamp, int amount) {
+    TimerWheel **w = &sh->windows[g / nshards];
+    if (!*w) {
+        if (!(*w = malloc(sizeof(TimerWheel)))) return -1;
+        tw_init(*w, window_time(timestamp));
+    }
+    uint32_t i = tw_alloc(&sh->timers);
+    if (i == TW_NIL) return -1;
+    sh->timers.timers[i] = (Timer){ window_time(timestamp) + violation_window, vtable_key(g, u), amount, TW_NIL };
+    if (tw_add(*w, &sh->timers, i)) {
+        tw_release(&sh->timers, i);
+        return 0;
+    }
+    return 1;
+}
+
+/* Match one chat message and apply the threshold rule. */
+static void moderate(Shard *sh, const Message *msg) {
+    int g = msg->modifyingGroup;
+    int u = msg->user;
+    if (g < 0 || g >= ngroups || u < 0) {
+        fprintf(stderr, "moderator: dropping message with bad group/user %d/%d\n", g, u);
+        return;
+    }
+
+    /* CHATMOD_WINDOW: the group's clock moves to this message; older violations drop out. */
+    if (violation_window && sh->windows[g / nshards]) {
+        tw_advance(sh->windows[g / nshards], &sh->timers, window_time(msg->timestamp), window_expire, sh);
+    }
+
+    /* Count how many *unique* filtered words appear (case-insensitive substrings).
+       A text seen before is answered from the verdict cache; otherwise clean
+       messages are rejected by the prefilter without touching the automaton. */
+    int timed = (sh->stats.moderated++ & MATCH_SAMPLE_MASK) == 0;
+    uint64_t started = timed ? stats_now_ns() : 0;
+    const Matcher *m = atomic_load_explicit(&matcher, memory_order_acquire);
+    if ((uint32_t)m->nwords > sh->word_cap) {
+        uint32_t *seen = calloc(m->nwords, sizeof(uint32_t));
+        if (!seen) {
+            perror("moderator: growing word scratch");
+            return;
+        }
+        free(sh->word_seen);
+        sh->word_seen = seen;
+        sh->word_cap = m->nwords;
+    }
+    size_t len = strnlen(msg->mtext, MAX_TEXT_SIZE);
+    uint64_t hash = 0;
+    int localViolations = -1;
+    if (vcache_enabled(&sh->cache)) {
+        hash = vcache_hash(msg->mtext, len);
+        localViolations = vcache_get(&sh->cache, hash, msg->mtext, len, m->generation);
+    }
+    if (localViolations < 0) {
+        char folded[MAX_TEXT_SIZE + MATCHER_FOLD_PAD];
+        localViolations = 0;
+        if (matcher_prefilter(m, msg->mtext, len, folded)) {
+            localViolations = matcher_count(m, folded, len, sh->word_seen, &sh->word_stamp);
+        } else {
+            sh->stats.prefilter_rejects++;
+        }
+        if (vcache_enabled(&sh->cache)) {
+            vcache_put(&sh->cache, hash, msg->mtext, len, m->generation, localViolations);
+        }
+    }
+    if (timed) lat_add(&sh->stats.match_ns, (uint32_t)(stats_now_ns() - started));
+    if (localViolations == 0) return;
+    sh->stats.violations += localViolations;
+    sh->verdicts[g / nshards].violations += localViolations;
+
+    /* Update global violation count for (g,u) */
+    int32_t *count = vtable_get(&sh->violations, g, u);
+    if (!count) {
+        perror("moderator: growing violation table");
+        return;
+    }
+    if (violation_window) {
+        if (*count == WINDOW_REMOVED) return;
+        int counted = window_add(sh, g, u, msg->timestamp, localViolations);
+        if (counted < 0) {
+            perror("moderator: scheduling violation expiry");
+            return;
+        }
+        if (!counted) {
+            if (*count == 0) vtable_remove(&sh->violations, vtable_key(g, u));
+            return;
+        }
+    }
+    *count += localViolations;
+    if (vlog) vlog_push(vlog, sh->id, (uint32_t)g, (uint32_t)u, *count);
+
+    /* If >= threshold => remove user => send message to group.
+       The assignment says: if user is to be deleted after crossing threshold -> print once,
+       so only act when this message is the one that crossed it. */
+    if (*count >= violation_threshold && *count - localViolations < violation_threshold) {
+        /* user just crossed threshold => remove them */
+        printf("User %d from group %d has been removed due to %d violations.\n",
+               u, g, *count);
+
+        /* Send removal message to the group over its control FIFO. */
+        ModMessage removeMsg;
+        removeMsg.mtype = g+1;
+        removeMsg.group_id = g;
+        removeMsg.user_id = u;
+        removeMsg.removeUser = 1;
+        queue_removal(sh, &removeMsg);
+        sh->stats.removals++;
+        sh->verdicts[g / nshards].removals++;
+        if (violation_window) *count = WINDOW_REMOVED;
+    }
+}
+
+/* Worker: drain this shard's queue and owned rings in turn, sleep on the doorbell
+   when all are empty. A message with mtype 0 on the queue is the shutdown sentinel. */
+static void *shard_main(void *arg) {
+    Shard *sh = (Shard *)arg;
+    int stop = 0;
+    qsbr_online(&matcher_qsbr, sh->id);
+    while (!stop) {
+        int did = drain_queue(sh, SHARD_DRAIN_BUDGET, &stop);
+        for (int r = 0; r < sh->nrings && !stop; r++) {
+            did += drain_ring(sh, sh->rings[r], SHARD_DRAIN_BUDGET);
+        }
+        flush_removals(sh);
+        qsbr_quiescent(&matcher_qsbr, sh->id);
+        if (stats) shard_advertise_room(sh);
+        /* Publish at most once per interval; an idle shard with unpublished counts
+           sleeps with a timeout so that they still go out. */
+        int unpublished = 0;
+        if (stats) {
+            uint64_t now = stats_now_ns();
+            if (now - sh->stats_published >= STATS_INTERVAL_NS) {
+                if (sh->stats.moderated != sh->published_moderated) shard_publish_stats(sh);
+                sh->published_moderated = sh->stats.moderated;
+                sh->stats_published = now;
+            }
+            unpublished = sh->stats.moderated != sh->published_moderated;
+        }
+        if (did || stop) continue;
+
+        /* Poll for a while first if work has been coming back quickly (waiter.h). */
+        waiter_begin(&sh->waiter);
+        int ready;
+        while (!(ready = shard_has_work(sh)) && waiter_next(&sh->waiter)) {
+        }
+        if (!ready) {
+            uint32_t ticket = doorbell_ticket(sh->bell);
+            if (!shard_has_work(sh)) {
+                struct timespec interval = { 0, (long)STATS_INTERVAL_NS };
+                qsbr_offline(&matcher_qsbr, sh->id);
+                doorbell_wait(sh->bell, ticket, unpublished ? &interval : NULL);
+                qsbr_online(&matcher_qsbr, sh->id);
+            }
+        }
+        waiter_end(&sh->waiter);
+    }
+    /* Whatever the groups had already written still gets a verdict. */
+    for (int r = 0; r < sh->nrings; r++) {
+        while (drain_ring(sh, sh->rings[r], SHARD_DRAIN_BUDGET) > 0) {
+        }
+    }
+    flush_removals(sh);
+    qsbr_offline(&matcher_qsbr, sh->id);
+    if (stats) shard_publish_stats(sh);
+    return NULL;
+}
+
+/* Flusher: group-commit whatever the shards have logged every CHATMOD_STATE_SYNC_MS,
+   or sooner if a shard's ring is filling up. */
+static void *flusher_main(void *arg) {
+    struct timespec interval = { 0, env_long("CHATMOD_STATE_SYNC_MS", 5) * 1000000L };
+    if (interval.tv_nsec <= 0 || interval.tv_nsec >= 1000000000L) interval.tv_nsec = 5000000L;
+    int failed = 0;
+    while (1) {
+        int stopping = atomic_load(&vlog_stop);
+        uint32_t ticket = doorbell_ticket(&vlog->bell);
+        if (vlog_commit(vlog) < 0 && !failed) {
+            perror("moderator: writing violation log");
+            failed = 1;
+        }
+        if (stopping) break;
+        doorbell_wait(&vlog->bell, ticket, &interval);
+    }
+    return arg;
+}
+
+/* Build a matcher from `path` and make it the active one. The shards keep
+   matching with the old one meanwhile; it is freed once none can still hold it. */
+static int reload_matcher(const char *path) {
+    Matcher *fresh = calloc(1, sizeof(Matcher));
+    if (!fresh || matcher_load(fresh, path, match_mode) < 0) {
+        if (fresh) matcher_free(fresh);   /* a failed load keeps what it had built */
+        free(fresh);
+        return -1;
+    }
+    /* Verdicts cached under the old word list stop matching once this is live. */
+    fresh->generation = atomic_load_explicit(&matcher, memory_order_relaxed)->generation + 1;
+    Matcher *old = atomic_exchange_explicit(&matcher, fresh, memory_order_acq_rel);
+    qsbr_synchronize(&matcher_qsbr);
+    matcher_free(old);
+    free(old);
+    return fresh->nwords;
+}
+
+/* Reload thread: watch the testcase directory (editors often replace the file
+   by renaming over it) and rebuild once changes to filtered_words.txt settle. */
+static void *reload_main(void *arg) {
+    const char *path = (const char *)arg;
+    char dir_buf[256], base_buf[256];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    snprintf(base_buf, sizeof(base_buf), "%s", path);
+    const char *dir = dirname(dir_buf);
+    const char *base = basename(base_buf);
+
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0) {
+        perror("moderator: watching filtered_words.txt");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+
+    _Alignas(struct inotify_event) char buf[4096];
+    int dirty = 0;
+    while (1) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, dirty ? RELOAD_SETTLE_MS : -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (ready == 0) {
+            dirty = 0;
+            int words = reload_matcher(path);
+            if (words < 0) {
+                fprintf(stderr, "moderator: could not reload %s, keeping the current word list\n", path);
+            } else {
+                fprintf(stderr, "moderator: reloaded %d filtered words from %s\n", words, path);
+            }
+            continue;
+        }
+        ssize_t len = read(fd, buf, sizeof(buf));
+        if (len <= 0) continue;
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len > 0 && strcmp(ev->name, base) == 0) dirty = 1;
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Dispatcher side: hand a pooled message to a shard, waiting if its queue is full. */
+static void shard_push(Shard *sh, MsgHandle h) {
+    MsgHandle *slot;
+    while (!(slot = spsc_reserve(sh->queue))) {
+        spsc_wait_space(sh->queue);
+    }
+    *slot = h;
+    if (spsc_publish(sh->queue)) {
+        doorbell_ring(sh->bell);
+    }
+}
+
+/* Unpack a group's batch (rcv bytes as returned by msgrcv) into its shard's queue. */
+static void dispatch_batch(Shard *shards, const ChatBatch *b, ssize_t rcv) {
+    size_t header = batch_msgsz(0);
+    if (rcv < (ssize_t)header || b->group < 0 || b->group >= ngroups) {
+        fprintf(stderr, "moderator: dropping malformed batch\n");
+        return;
+    }
+    Shard *sh = &shards[b->group % nshards];
+    size_t used = (size_t)rcv - header, off = 0;
+    BatchEntry e;
+    const char *text;
+    while (batch_next(b, used, &off, &e, &text)) {
+        if (e.len >= MAX_TEXT_SIZE) continue;
+        MsgHandle h = pool_alloc(&pool);
+        Message *m = pool_record(&pool, h);
+        m->mtype = BATCH_MTYPE;   /* anything but the 0 stop sentinel */
+        m->timestamp = e.timestamp;
+        m->user = e.user;
+        memcpy(m->mtext, text, e.len);
+        m->mtext[e.len] = '\0';
+        m->modifyingGroup = b->group;
+        m->sent_us = e.sent_us;
+        shard_push(sh, h);
     }
 }
 
@@ -57,128 +571,338 @@ snprintf(testcase_folder, sizeof(testcase_folder), "./testcase_%s", argv[1]);
     char input_file_path[128];
 snprintf(input_file_path, sizeof(input_file_path), "%s/input.txt", testcase_folder);
 
-    FILE *fp = fopen(input_file_path, "r");
-    if (!fp) {
-        perror("fopen input.txt in moderator");
-        exit(EXIT_FAILURE);
+    /* A compiled manifest (compile.out) has the keys and the automaton already built;
+       it stays mapped for the life of the process, since the matcher points into it. */
+    static Manifest manifest;
+    int n, validation_key, app_key;
+    if (manifest_try_open(&manifest, testcase_folder, "moderator") == 0) {
+        n = manifest.h->ngroups;
+        validation_key = manifest.h->validation_key;
+        app_key = manifest.h->app_key;
+        moderator_key = manifest.h->moderator_key;
+        violation_threshold = manifest.h->violation_threshold;
+    }
+    else {
+        FILE *fp = fopen(input_file_path, "r");
+        if (!fp) {
+            perror("fopen input.txt in moderator");
+            exit(EXIT_FAILURE);
+        }
+        fscanf(fp, "%d", &n);
+        fscanf(fp, "%d", &validation_key);
+        fscanf(fp, "%d", &app_key);
+        fscanf(fp, "%d", &moderator_key);
+        fscanf(fp, "%d", &violation_threshold);
+        /* skip group file names */
+        for(int i=0; i<n; i++){
+            char tmp[128];
+            fscanf(fp, "%s", tmp); // discard
+        }
+        fclose(fp);
     }
-    int n, validation_key, app_key, moderator_key, violation_threshold;
-    fscanf(fp, "%d", &n);
-    fscanf(fp, "%d", &validation_key);
-    fscanf(fp, "%d", &app_key);
-    fscanf(fp, "%d", &moderator_key);
-    fscanf(fp, "%d", &violation_threshold);
-    /* skip group file names */
-    for(int i=0; i<n; i++){
-        char tmp[128];
-        fscanf(fp, "%s", tmp); // discard
-    }
-    fclose(fp);
-
-    /* We also must read filtered_words.txt to build a list of restricted words. */
-    char filtered_path[128];
+    ngroups = n;
+
+    /* We also must read filtered_words.txt to build a list of restricted words.
+       All of them are compiled into one automaton, so matching cost does not grow with the list.
+       The manifest's copy is built with the whole-word set, so it serves either mode;
+       a reload always reads the text file. */
+    static char filtered_path[128];
 snprintf(filtered_path, sizeof(filtered_path), "%s/filtered_words.txt", testcase_folder);
-    FILE *fwords = fopen(filtered_path, "r");
-    if (!fwords) {
+    match_mode = env_is("CHATMOD_MATCH", "word") ? MATCH_WORD : MATCH_SUBSTRING;
+    Matcher *initial = calloc(1, sizeof(Matcher));
+    if (initial && manifest.h) {
+        manifest_matcher(&manifest, initial);
+        initial->mode = match_mode;
+    }
+    else if (!initial || matcher_load(initial, filtered_path, match_mode) < 0) {
         perror("fopen filtered_words.txt");
         exit(EXIT_FAILURE);
     }
-    char filtered_words[MAX_FILTERED][MAX_WORD_LEN+1];
-    int filtered_count = 0;
-    while (filtered_count < MAX_FILTERED && fscanf(fwords, "%s", filtered_words[filtered_count]) == 1) {
-        /* convert each word to lowercase */
-        toLowerCase(filtered_words[filtered_count]);
-        filtered_count++;
-    }
-    fclose(fwords);
+    initial->generation = 1;
+    atomic_store(&matcher, initial);
 
     /* Setup message queue for reading from groups */
-    int mod_msqid = msgget(moderator_key, IPC_CREAT | 0666);
+    mod_msqid = msgget(moderator_key, IPC_CREAT | 0666);
     if (mod_msqid < 0) {
         perror("msgget moderator");
         exit(EXIT_FAILURE);
     }
 
-    /* We track violations per group+user: violations[group][user]. 
-       But user can be up to 50. group up to 30 => 30x50 array 
+    /* CHATMOD_PIN=on: the moderator keeps to the cores it reserves (see topology.h);
+       threads started from here on inherit that set until placed on one CPU each. */
+    Placement placement;
+    int pinned = 0;
+    if (topo_pinning()) {
+        Topology topo;
+        if (topo_load(&topo) == 0) {
+            topo_place(&topo, &placement);
+            topo_print(&topo, &placement, "moderator");
+            topo_free(&topo);
+            pinned = sched_setaffinity(0, sizeof(placement.moderator), &placement.moderator) == 0;
+        }
+        if (!pinned) fprintf(stderr, "moderator: could not pin to its CPUs, running unpinned\n");
+    }
+
+    /* Worker pool: CHATMOD_MOD_THREADS shards, default one per online CPU, or per
+       reserved CPU when pinned (never more than there are groups to spread). */
+    long cpus = pinned ? CPU_COUNT(&placement.moderator) : sysconf(_SC_NPROCESSORS_ONLN);
+    nshards = (int)env_long("CHATMOD_MOD_THREADS", cpus > 0 ? cpus : 1);
+    batch_verdicts = env_long("CHATMOD_BATCH", 1) > 1;
+    if (nshards > n && n > 0) nshards = n;
+    if (nshards < 1) nshards = 1;
+    if (nshards > SHM_MAX_SHARDS) nshards = SHM_MAX_SHARDS;
+
+    /* Optional shared-memory transport: groups write into per-group rings we consume directly. */
+    ShmHeader *shm = NULL;
+    if (env_is("CHATMOD_TRANSPORT", "shm")) {
+        uint32_t slots = 1;
+        while (slots < (uint32_t)env_long("CHATMOD_SHM_SLOTS", 4096)) slots <<= 1;
+        shm = shm_transport_create(moderator_key, n, nshards, slots, sizeof(Message));
+        if (!shm) {
+            perror("creating shared memory transport");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* We track violations per group+user. Each shard keeps a hash table for its own
+       groups, holding only the users that have violated so far. With CHATMOD_WINDOW
+       only violations from the last W timestamp units count: each group gets a timer
+       wheel (see twheel.h) that takes them back off as its timestamps move on, and a
+       user whose count drops to zero leaves the table.
     */
-    static int violations[MAX_GROUPS][50];
-    memset(violations, 0, sizeof(violations));
+    long window = env_long("CHATMOD_WINDOW", 0);
+    violation_window = window > 0 ? (uint64_t)(window < INT32_MAX ? window : INT32_MAX) : 0;
+    /* Workers never see SIGINT/SIGTERM; the dispatcher gets them (without SA_RESTART)
+       so that its msgrcv() returns EINTR and it stops the pool. */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_shutdown_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);  /* a group closing its control FIFO is not fatal */
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, NULL);
+
+    raise_fd_limit();  /* one control FIFO per group, possibly thousands */
+
+    int rows = (n + nshards - 1) / nshards;
+    if (rows < 1) rows = 1;
+    /* Counters for stats.out; the run goes on without them if the segment cannot be made. */
+    stats = stats_create(moderator_key, n, nshards);
+    if (!stats) {
+        perror("moderator: creating stats segment");
+    }
+
+    Shard *shards = aligned_alloc(SPSC_CACHELINE, nshards * sizeof(Shard));
+    if (!shards) {
+        perror("allocating shards");
+        exit(EXIT_FAILURE);
+    }
+    memset(shards, 0, nshards * sizeof(Shard));
+    /* Enough records to fill every shard's queue, plus a few being received or moderated. */
+    if (qsbr_init(&matcher_qsbr, nshards) < 0 ||
+        pool_init(&pool, (uint32_t)nshards * (SHARD_QUEUE_SLOTS + 2) + 2, sizeof(Message), nshards) < 0) {
+        perror("allocating shards");
+        exit(EXIT_FAILURE);
+    }
+    /* CHATMOD_VERDICT_CACHE: texts remembered per shard (0 turns the cache off). */
+    long cache_entries = env_long("CHATMOD_VERDICT_CACHE", 4096);
+    if (cache_entries < 0) cache_entries = 0;
+    for (int k = 0; k < nshards; k++) {
+        Shard *sh = &shards[k];
+        sh->id = k;
+        sh->queue = aligned_alloc(SPSC_CACHELINE, spsc_bytes(SHARD_QUEUE_SLOTS, sizeof(MsgHandle)));
+        sh->word_cap = initial->nwords > 0 ? initial->nwords : 1;
+        sh->word_seen = calloc(sh->word_cap, sizeof(uint32_t));
+        sh->control_fds = malloc(rows * sizeof(int));
+        sh->verdicts = calloc(rows, sizeof(GroupVerdicts));
+        sh->removals = malloc(CONTROL_BATCH * sizeof(ModMessage));
+        sh->windows = calloc(rows, sizeof(TimerWheel *));
+        tw_pool_init(&sh->timers);
+        if (!sh->queue || vtable_init(&sh->violations) < 0 || !sh->word_seen || !sh->control_fds ||
+            !sh->verdicts || !sh->removals || !sh->windows || vcache_init(&sh->cache, (uint32_t)cache_entries, MAX_TEXT_SIZE) < 0) {
+            perror("allocating shard");
+            exit(EXIT_FAILURE);
+        }
+        for (int r = 0; r < rows; r++) sh->control_fds[r] = -1;
+        spsc_init(sh->queue, SHARD_QUEUE_SLOTS, sizeof(MsgHandle));
+        sh->advertised_room = SHARD_QUEUE_SLOTS;
+        waiter_init(&sh->waiter);
+        if (stats) atomic_store(&stats_shard(stats, k)->room, SHARD_QUEUE_SLOTS);
+        sh->bell = shm ? shm_transport_bell(shm, k) : &sh->local_bell;
+        if (shm) {
+            sh->rings = calloc((n + nshards - 1) / nshards + 1, sizeof(SpscRing *));
+            if (!sh->rings) {
+                perror("allocating shard rings");
+                exit(EXIT_FAILURE);
+            }
+            for (int g = k; g < n; g += nshards) {
+                sh->rings[sh->nrings++] = shm_transport_ring(shm, g);
+            }
+        }
+    }
+
+    /* Recover violation counts before any shard runs. Pairs for groups this
+       testcase does not have are kept in the log but not loaded. */
+    const char *state_dir = env_str("CHATMOD_STATE_DIR", NULL);
+    if (state_dir && violation_window) {
+        fprintf(stderr, "moderator: CHATMOD_STATE_DIR keeps lifetime counts; not used with CHATMOD_WINDOW\n");
+        state_dir = NULL;
+    }
+    pthread_t flusher_tid;
+    if (state_dir) {
+        static VLog state;
+        uint64_t started = stats_now_ns();
+        if (vlog_open(&state, state_dir, nshards) < 0) {
+            perror("moderator: opening CHATMOD_STATE_DIR");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t recovered = 0;
+        for (uint32_t i = 0; i < (1u << state.mirror.bits); i++) {
+            const VEntry *e = &state.mirror.slots[i];
+            uint32_t g = (uint32_t)(e->key >> 32);
+            if (e->key == VTABLE_EMPTY || g >= (uint32_t)n) continue;
+            int32_t *count = vtable_get(&shards[g % nshards].violations, g, (uint32_t)e->key);
+            if (!count) {
+                perror("moderator: recovering violation counts");
+                exit(EXIT_FAILURE);
+            }
+            *count = e->count;
+            recovered++;
+        }
+        fprintf(stderr, "moderator: recovered %u violation counts from %s in %.1f ms\n", recovered,
+                state_dir, (stats_now_ns() - started) / 1e6);
+        vlog = &state;
+        if (pthread_create(&flusher_tid, NULL, flusher_main, NULL) != 0) {
+            fprintf(stderr, "Error: could not start the violation log flusher\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int k = 0; k < nshards; k++) {
+        if (pthread_create(&shards[k].tid, NULL, shard_main, &shards[k]) != 0) {
+            fprintf(stderr, "Error: could not start moderator shard %d\n", k);
+            exit(EXIT_FAILURE);
+        }
+        if (pinned) {
+            cpu_set_t one;
+            CPU_ZERO(&one);
+            CPU_SET(topo_nth_cpu(&placement.moderator, k), &one);
+            pthread_setaffinity_np(shards[k].tid, sizeof(one), &one);
+            fprintf(stderr, "moderator: shard %d on cpu %d\n", k, topo_nth_cpu(&placement.moderator, k));
+        }
+    }
+
+    /* Pick up edits to filtered_words.txt while running (CHATMOD_RELOAD=0 turns this off).
+       The thread is never joined; it just goes away with the process. */
+    if (env_long("CHATMOD_RELOAD", 1)) {
+        pthread_t reload_tid;
+        if (pthread_create(&reload_tid, NULL, reload_main, filtered_path) == 0) {
+            pthread_detach(reload_tid);
+        } else {
+            fprintf(stderr, "moderator: could not start the reload thread\n");
+        }
+    }
+
+    /* The dispatcher takes the next reserved CPU after the shards', sharing one only
+       when there are more threads than CPUs. */
+    if (pinned) {
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(topo_nth_cpu(&placement.moderator, nshards), &one);
+        pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+        fprintf(stderr, "moderator: dispatcher on cpu %d\n", topo_nth_cpu(&placement.moderator, nshards));
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &stop_signals, NULL);
 
     /* Repeatedly read from queue until something ends. We'll break on error if 
        the queue is destroyed or we get an unexpected error. 
+       This thread only receives and routes; matching happens on the shards.
     */
-    while(1) {
-        Message msg;
-        ssize_t rcv = msgrcv(mod_msqid, &msg, sizeof(msg) - sizeof(msg.mtype), 0 /* read any mtype */, 0);
+    Waiter dispatch_waiter;
+    waiter_init(&dispatch_waiter);
+    static ChatBatch in;   /* CHATMOD_BATCH: many messages from one group */
+    while (!stop_requested) {
+        /* Everything is received straight into a pooled record. Batches do not fit one,
+           so msgrcv() leaves them queued with E2BIG and they come in through `in`, to be
+           unpacked into records of their own; that costs one extra call per batch, not
+           per message. */
+        MsgHandle h = pool_alloc(&pool);
+        Message *msg = pool_record(&pool, h);
+        ssize_t rcv = waiter_msgrcv(&dispatch_waiter, mod_msqid, msg, sizeof(*msg) - sizeof(long),
+                                    0 /* read any mtype */);
+        int pooled = 1;
+        if (rcv < 0 && errno == E2BIG) {
+            pooled = 0;
+            rcv = waiter_msgrcv(&dispatch_waiter, mod_msqid, &in, sizeof(in) - sizeof(long), 0);
+        }
         if (rcv < 0) {
+            pool_free(&pool, h);
             if (errno == EIDRM || errno == EINTR) {
                 // The queue might have been removed => exit
                 break;
             }
-            if (errno == ENOMSG) {
-                // No message => maybe sleep
-                usleep(100000);
-                continue;
-            }
             perror("msgrcv in moderator");
             break;
         }
+        if (!pooled) {
+            pool_free(&pool, h);
+            if (in.mtype == BATCH_MTYPE) {
+                dispatch_batch(shards, &in, rcv);
+            } else {
+                fprintf(stderr, "moderator: dropping oversized message of type %ld\n", in.mtype);
+            }
+            continue;
+        }
 
         /* Check if this is a group creation (mtype=1), user addition (mtype=2), group termination (mtype=3).
            Typically, we only care about actual user messages from group, i.e. (mtype = 30 + group#).
            We'll assume any large mtype means a user message. 
            For mtype=1,2,3, we can ignore. 
         */
-        if (msg.mtype == 1 || msg.mtype == 2 || msg.mtype == 3) {
+        if (msg->mtype == 1 || msg->mtype == 2 || msg->mtype == 3) {
             // ignore
+            pool_free(&pool, h);
             continue;
         }
 
-        /* Otherwise, it's presumably a user message. We do substring checks. */
-        int g = msg.modifyingGroup;
-        int u = msg.user;
-        // Convert msg.mtext to lowercase:
-        char textLower[MAX_TEXT_SIZE];
-        strncpy(textLower, msg.mtext, sizeof(textLower)-1);
-        textLower[MAX_TEXT_SIZE-1] = '\0';
-        toLowerCase(textLower);
-
-        /* Count how many *unique* filtered words appear. 
-           We'll do a naive approach: for each filtered word, check if it is a substring of textLower. 
-           If yes, increment local violation count. 
-        */
-        int localViolations = 0;
-        for(int i=0; i<filtered_count; i++){
-            if (strstr(textLower, filtered_words[i]) != NULL) {
-                // found as substring => 1 violation for that word
-                localViolations++;
-            }
-        }
+        /* Otherwise, it's presumably a user message: hand it to the shard owning its group. */
+        shard_push(&shards[(msg->modifyingGroup >= 0 ? msg->modifyingGroup : 0) % nshards], h);
+    }
 
-        /* Update global violation count for (g,u) */
-        violations[g][u] += localViolations;
-
-        /* If >= threshold => remove user => send message to group. */
-        if (violations[g][u] >= violation_threshold && localViolations>0) {
-            // Print removal only once or every time? 
-            // The assignment says: if user is to be deleted after crossing threshold -> print once.
-            // We can check if exactly now crossed threshold:
-            if (violations[g][u] - localViolations < violation_threshold) {
-                /* user just crossed threshold => remove them */
-                printf("User %d from group %d has been removed due to %d violations.\n",
-                       u, g, violations[g][u]);
-
-                /* Send removal message to group => use mtype = group_index+1 or similar. */
-                ModMessage removeMsg;
-                removeMsg.mtype = g+1;  // group listens on this type
-                removeMsg.group_id = g;
-                removeMsg.user_id = u;
-                removeMsg.removeUser = 1;
-                msgsnd(mod_msqid, &removeMsg, sizeof(removeMsg) - sizeof(removeMsg.mtype), 0);
-            }
-        }
+    /* Drain and stop the workers. */
+    for (int k = 0; k < nshards; k++) {
+        MsgHandle h = pool_alloc(&pool);
+        ((Message *)pool_record(&pool, h))->mtype = 0;
+        shard_push(&shards[k], h);
+    }
+    LatencyHist latency;
+    memset(&latency, 0, sizeof(latency));
+    for (int k = 0; k < nshards; k++) {
+        pthread_join(shards[k].tid, NULL);
+        lat_merge(&latency, &shards[k].latency);
+    }
+    if (vlog) {
+        atomic_store(&vlog_stop, 1);
+        doorbell_ring(&vlog->bell);
+        pthread_join(flusher_tid, NULL);
+        vlog_close(vlog);
+    }
+    pool_destroy(&pool);
+    const char *latency_file = env_str("CHATMOD_LATENCY_FILE", NULL);
+    if (latency_file && lat_save(&latency, latency_file) < 0) {
+        perror("writing CHATMOD_LATENCY_FILE");
+    }
+    if (shm) {
+        shm_transport_destroy(shm, moderator_key);
+    }
+    if (stats) {
+        stats_destroy(stats, moderator_key);
     }
 
     return 0;
-}
\ No newline at end of file
+}
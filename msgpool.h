@@ -0,0 +1,114 @@
+/***************************************************
+ * msgpool.h
+ *
+ * A slab of fixed-size records passed around by 32-bit handle, so a message
+ * can be written once where it is received and then travel through queues as
+ * four bytes instead of being copied at every hop.
+ *
+ * One thread owns the pool: it allocates from a plain free stack. The threads
+ * it hands records to give them back through one return ring each (an
+ * SpscRing of handles, sized so it can never fill), and the owner drains
+ * those rings only when its free stack runs dry. An owner that finds nothing
+ * to take back sleeps on a doorbell the returning threads ring on the
+ * empty -> non-empty transition.
+ ***************************************************/
+#ifndef MSGPOOL_H
+#define MSGPOOL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc.h"
+
+typedef uint32_t MsgHandle;
+
+typedef struct {
+    unsigned char *slab;
+    uint32_t record_size;
+    uint32_t capacity;
+    MsgHandle *free;        /* owner only */
+    uint32_t nfree;
+    SpscRing **returns;     /* one per returning thread */
+    int nreturns;
+    Doorbell returned;
+} MsgPool;
+
+static inline void *pool_record(const MsgPool *p, MsgHandle h) {
+    return p->slab + (size_t)h * p->record_size;
+}
+
+static inline uint32_t pool_pow2(uint32_t n) {
+    uint32_t p = 1;
+    while (p < n) p <<= 1;
+    return p;
+}
+
+/* Returns 0 on success, -1 if out of memory. Every record starts free. */
+static inline int pool_init(MsgPool *p, uint32_t capacity, uint32_t record_size, int nreturns) {
+    memset(p, 0, sizeof(*p));
+    record_size = (record_size + 7) & ~7u;
+    p->slab = aligned_alloc(SPSC_CACHELINE, ((size_t)capacity * record_size + SPSC_CACHELINE - 1) &
+                                                ~(size_t)(SPSC_CACHELINE - 1));
+    p->free = malloc((size_t)capacity * sizeof(MsgHandle));
+    p->returns = calloc(nreturns > 0 ? nreturns : 1, sizeof(SpscRing *));
+    if (!p->slab || !p->free || !p->returns) return -1;
+    p->record_size = record_size;
+    p->capacity = capacity;
+    for (uint32_t i = 0; i < capacity; i++) p->free[i] = capacity - 1 - i;
+    p->nfree = capacity;
+    uint32_t slots = pool_pow2(capacity);
+    for (int k = 0; k < nreturns; k++) {
+        p->returns[k] = aligned_alloc(SPSC_CACHELINE, spsc_bytes(slots, sizeof(MsgHandle)));
+        if (!p->returns[k]) return -1;
+        spsc_init(p->returns[k], slots, sizeof(MsgHandle));
+    }
+    p->nreturns = nreturns;
+    return 0;
+}
+
+/* Owner: take back whatever has been returned. Returns how many records. */
+static inline uint32_t pool_reclaim(MsgPool *p) {
+    uint32_t got = 0;
+    for (int k = 0; k < p->nreturns; k++) {
+        MsgHandle *h;
+        while ((h = spsc_front(p->returns[k]))) {
+            p->free[p->nfree++] = *h;
+            spsc_pop(p->returns[k]);
+            got++;
+        }
+    }
+    return got;
+}
+
+/* Owner: a free record, waiting for one to be returned if need be. */
+static inline MsgHandle pool_alloc(MsgPool *p) {
+    while (p->nfree == 0) {
+        uint32_t ticket = doorbell_ticket(&p->returned);
+        if (pool_reclaim(p)) break;
+        doorbell_wait(&p->returned, ticket, NULL);
+    }
+    return p->free[--p->nfree];
+}
+
+/* Owner: put back a record it never handed out. */
+static inline void pool_free(MsgPool *p, MsgHandle h) {
+    p->free[p->nfree++] = h;
+}
+
+/* Returning thread `k`: give a record back. Never blocks; the ring holds every handle. */
+static inline void pool_release(MsgPool *p, int k, MsgHandle h) {
+    SpscRing *r = p->returns[k];
+    *(MsgHandle *)spsc_reserve(r) = h;
+    if (spsc_publish(r)) doorbell_ring(&p->returned);
+}
+
+static inline void pool_destroy(MsgPool *p) {
+    for (int k = 0; k < p->nreturns; k++) free(p->returns[k]);
+    free(p->returns);
+    free(p->free);
+    free(p->slab);
+    memset(p, 0, sizeof(*p));
+}
+
+#endif /* MSGPOOL_H */
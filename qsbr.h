@@ -0,0 +1,74 @@
+/***************************************************
+ * qsbr.h
+ *
+ * Quiescent-state-based reclamation for objects that readers pick up through
+ * an atomic pointer (the moderator's matcher). A writer publishes a new
+ * object by swapping the pointer, then calls qsbr_synchronize(); once that
+ * returns, no reader can still be using the old one and it can be freed.
+ * Readers never take a lock or wait on the writer.
+ *
+ * Each reader thread reports a quiescent state (holding no references)
+ * between units of work, and goes offline while it sleeps so a blocked
+ * reader does not hold up reclamation.
+ ***************************************************/
+#ifndef QSBR_H
+#define QSBR_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#define QSBR_OFFLINE UINT64_MAX
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t seen;   /* last epoch observed, or QSBR_OFFLINE */
+} QsbrReader;
+
+typedef struct {
+    _Atomic uint64_t epoch;
+    QsbrReader *readers;
+    int nreaders;
+} Qsbr;
+
+/* Returns 0 on success, -1 if out of memory. Readers start offline. */
+static inline int qsbr_init(Qsbr *q, int nreaders) {
+    q->readers = aligned_alloc(64, (size_t)(nreaders > 0 ? nreaders : 1) * sizeof(QsbrReader));
+    if (!q->readers) return -1;
+    atomic_init(&q->epoch, 1);
+    q->nreaders = nreaders;
+    for (int i = 0; i < nreaders; i++) atomic_init(&q->readers[i].seen, QSBR_OFFLINE);
+    return 0;
+}
+
+/* Reader: holds no references right now. */
+static inline void qsbr_quiescent(Qsbr *q, int reader) {
+    atomic_store_explicit(&q->readers[reader].seen,
+                          atomic_load_explicit(&q->epoch, memory_order_seq_cst), memory_order_seq_cst);
+}
+
+/* Reader: about to pick up references again (after qsbr_offline()). */
+static inline void qsbr_online(Qsbr *q, int reader) {
+    qsbr_quiescent(q, reader);
+}
+
+/* Reader: holds no references until the next qsbr_online(), however long that is. */
+static inline void qsbr_offline(Qsbr *q, int reader) {
+    atomic_store_explicit(&q->readers[reader].seen, QSBR_OFFLINE, memory_order_seq_cst);
+}
+
+/* Writer: wait until every reader has passed a quiescent state (or gone offline)
+   since this call began. Call after unpublishing an object, before freeing it. */
+static inline void qsbr_synchronize(Qsbr *q) {
+    uint64_t target = atomic_fetch_add_explicit(&q->epoch, 1, memory_order_seq_cst) + 1;
+    struct timespec pause = { 0, 50000 };
+    for (int i = 0; i < q->nreaders; i++) {
+        while (1) {
+            uint64_t seen = atomic_load_explicit(&q->readers[i].seen, memory_order_seq_cst);
+            if (seen == QSBR_OFFLINE || seen >= target) break;
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+#endif /* QSBR_H */
@@ -0,0 +1,137 @@
+/***************************************************
+ * spsc.h
+ *
+ * Single-producer / single-consumer ring of fixed-size slots, plus a futex
+ * "doorbell" to sleep on when there is nothing to do. Everything is plain
+ * memory with no pointers inside, so a ring works the same whether it was
+ * malloc'd or lives in a shared mapping between processes.
+ *
+ * Wakeups are only paid on transitions: the producer rings the consumer's
+ * doorbell when it publishes into an empty ring, and the consumer rings the
+ * ring's `space` doorbell when it pops from a full one. Each doorbell keeps
+ * a sleeper count, so ringing with nobody asleep is a couple of atomics and
+ * no syscall.
+ ***************************************************/
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SPSC_CACHELINE 64
+
+typedef struct {
+    _Atomic uint32_t seq;
+    _Atomic uint32_t sleepers;
+} Doorbell;
+
+/* Not FUTEX_PRIVATE: doorbells may sit in memory shared between processes. */
+static inline void futex_wait_u32(_Atomic uint32_t *addr, uint32_t expected, const struct timespec *timeout) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAIT, expected, timeout, NULL, 0);
+}
+
+static inline void futex_wake_u32(_Atomic uint32_t *addr, int count) {
+    syscall(SYS_futex, (uint32_t *)addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+
+static inline void doorbell_ring(Doorbell *d) {
+    atomic_fetch_add(&d->seq, 1);
+    if (atomic_load(&d->sleepers) > 0) {
+        futex_wake_u32(&d->seq, 1 << 30);
+    }
+}
+
+/* Take a ticket before re-checking for work; pass it to doorbell_wait(). */
+static inline uint32_t doorbell_ticket(Doorbell *d) {
+    return atomic_load_explicit(&d->seq, memory_order_acquire);
+}
+
+/* Sleep until the doorbell rings after `ticket` was taken (or the timeout, if any). */
+static inline void doorbell_wait(Doorbell *d, uint32_t ticket, const struct timespec *timeout) {
+    atomic_fetch_add(&d->sleepers, 1);
+    futex_wait_u32(&d->seq, ticket, timeout);
+    atomic_fetch_sub(&d->sleepers, 1);
+}
+
+typedef struct {
+    _Alignas(SPSC_CACHELINE) _Atomic uint32_t tail;   /* written by the producer */
+    _Alignas(SPSC_CACHELINE) _Atomic uint32_t head;   /* written by the consumer */
+    _Alignas(SPSC_CACHELINE) uint32_t mask;           /* slots - 1 */
+    uint32_t slot_size;
+    Doorbell space;                                    /* rung when a full ring drains */
+    _Alignas(SPSC_CACHELINE) unsigned char slots[];
+} SpscRing;
+
+/* Bytes needed for a ring of `slots` (a power of two) entries. */
+static inline size_t spsc_bytes(uint32_t slots, uint32_t slot_size) {
+    return sizeof(SpscRing) + (size_t)slots * slot_size;
+}
+
+static inline void spsc_init(SpscRing *r, uint32_t slots, uint32_t slot_size) {
+    memset(r, 0, sizeof(*r));
+    r->mask = slots - 1;
+    r->slot_size = slot_size;
+}
+
+static inline void *spsc_slot(SpscRing *r, uint32_t pos) {
+    return r->slots + (size_t)(pos & r->mask) * r->slot_size;
+}
+
+/* Producer: slot to fill next, or NULL if the ring is full. */
+static inline void *spsc_reserve(SpscRing *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    if (tail - head > r->mask) return NULL;
+    return spsc_slot(r, tail);
+}
+
+/* Producer: make the reserved slot visible. Returns 1 if the ring was empty,
+   i.e. the consumer may be asleep and its doorbell should be rung. */
+static inline int spsc_publish(SpscRing *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load_explicit(&r->head, memory_order_relaxed) == tail;
+}
+
+/* Producer: block until spsc_reserve() can succeed. */
+static inline void spsc_wait_space(SpscRing *r) {
+    while (1) {
+        uint32_t ticket = doorbell_ticket(&r->space);
+        if (spsc_reserve(r)) return;
+        doorbell_wait(&r->space, ticket, NULL);
+    }
+}
+
+/* Consumer: oldest published slot, or NULL if the ring is empty. */
+static inline void *spsc_front(SpscRing *r) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail) return NULL;
+    return spsc_slot(r, head);
+}
+
+/* Consumer: release the slot returned by spsc_front(). */
+static inline void spsc_pop(SpscRing *r) {
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->tail, memory_order_relaxed) - head > r->mask) {
+        doorbell_ring(&r->space);
+    }
+}
+
+/* Either side: slots currently published and not yet popped (a snapshot). */
+static inline uint32_t spsc_depth(SpscRing *r) {
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    return tail - head;
+}
+
+#endif /* SPSC_H */
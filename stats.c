@@ -0,0 +1,188 @@
+/***************************************************
+ * stats.c
+ *
+ * Prints the counters a running moderator and its groups publish in the
+ * stats segment (see stats.h), without disturbing the run.
+ *
+ *   ./stats.out [-i interval_ms] [-g] <testcase_number>
+ *
+ * With -i it keeps printing, with per-second rates over each interval,
+ * until the moderator goes away. -g adds one line per group.
+ ***************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "stats.h"
+
+typedef struct {
+    GroupCounters group;         /* summed over groups */
+    ShardCounters shard;         /* summed over shards */
+    uint32_t groups_done;
+} Totals;
+
+static void read_totals(StatsHeader *h, Totals *t, GroupCounters *groups, GroupVerdicts *verdicts) {
+    memset(t, 0, sizeof(*t));
+    for (uint32_t g = 0; g < h->ngroups; g++) {
+        GroupSlot *slot = stats_group(h, g);
+        GroupCounters *c = &groups[g];
+        stats_read(&slot->seq, c, &slot->c, sizeof(*c));
+        t->group.forwarded += c->forwarded;
+        t->group.bytes_read += c->bytes_read;
+        t->group.reads += c->reads;
+        t->group.send_blocked += c->send_blocked;
+        t->group.ring_full += c->ring_full;
+        t->group.batches += c->batches;
+        t->group.pauses += c->pauses;
+        t->group.removed += c->removed;
+        t->group.throttled += c->throttled;
+        t->group.users += c->users;
+        t->groups_done += c->done;
+        if (!c->done) {
+            if (c->val_depth > t->group.val_depth) t->group.val_depth = c->val_depth;
+            if (c->mod_depth > t->group.mod_depth) t->group.mod_depth = c->mod_depth;
+        }
+    }
+    ShardCounters c;
+    for (uint32_t k = 0; k < h->nshards; k++) {
+        ShardSlot *slot = stats_shard(h, k);
+        stats_read(&slot->seq, &c, &slot->c, sizeof(c));
+        t->shard.moderated += c.moderated;
+        t->shard.prefilter_rejects += c.prefilter_rejects;
+        t->shard.violations += c.violations;
+        t->shard.expired += c.expired;
+        t->shard.removals += c.removals;
+        t->shard.queue_depth += c.queue_depth;
+        t->shard.idle_waits += c.idle_waits;
+        t->shard.idle_blocks += c.idle_blocks;
+        t->shard.cache_hits += c.cache_hits;
+        t->shard.cache_misses += c.cache_misses;
+        lat_merge(&t->shard.match_ns, &c.match_ns);
+        /* A shard's groups are published under its seqlock. */
+        uint32_t before;
+        do {
+            before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            for (uint32_t g = k; g < h->ngroups; g += h->nshards) verdicts[g] = *stats_verdicts(h, g);
+            atomic_thread_fence(memory_order_acquire);
+        } while ((before & 1) || atomic_load_explicit(&slot->seq, memory_order_relaxed) != before);
+    }
+}
+
+static double rate(uint64_t now, uint64_t before, double seconds) {
+    return seconds > 0 ? (double)(now - before) / seconds : 0.0;
+}
+
+static void print_totals(const StatsHeader *h, const Totals *t, const Totals *prev, double seconds) {
+    printf("uptime %.1f s, groups %u (%u done), users %u, shards %u\n",
+           (stats_now_ns() - h->started_ns) / 1e9, h->ngroups, t->groups_done, t->group.users, h->nshards);
+    printf("  groups:    forwarded %llu", (unsigned long long)t->group.forwarded);
+    if (prev) printf(" (%.0f/s)", rate(t->group.forwarded, prev->group.forwarded, seconds));
+    printf(", pipe bytes %llu in %llu reads, batches %llu, send blocked %llu, ring full %llu, throttled %llu, pauses %llu, removed %llu\n",
+           (unsigned long long)t->group.bytes_read, (unsigned long long)t->group.reads,
+           (unsigned long long)t->group.batches,
+           (unsigned long long)t->group.send_blocked, (unsigned long long)t->group.ring_full,
+           (unsigned long long)t->group.throttled,
+           (unsigned long long)t->group.pauses, (unsigned long long)t->group.removed);
+    printf("  queues:    validation %llu, moderator %llu (deepest seen by a live group), shards %llu\n",
+           (unsigned long long)t->group.val_depth, (unsigned long long)t->group.mod_depth,
+           (unsigned long long)t->shard.queue_depth);
+    printf("  moderator: moderated %llu", (unsigned long long)t->shard.moderated);
+    if (prev) printf(" (%.0f/s)", rate(t->shard.moderated, prev->shard.moderated, seconds));
+    printf(", prefilter rejects %llu, violations %llu (%llu expired), removals %llu, idle waits %llu (%llu blocked)\n",
+           (unsigned long long)t->shard.prefilter_rejects, (unsigned long long)t->shard.violations,
+           (unsigned long long)t->shard.expired, (unsigned long long)t->shard.removals,
+           (unsigned long long)t->shard.idle_waits, (unsigned long long)t->shard.idle_blocks);
+    printf("  match ns:  p50 %llu  p99 %llu  p999 %llu  (%llu samples)\n",
+           (unsigned long long)lat_quantile(&t->shard.match_ns, 0.50),
+           (unsigned long long)lat_quantile(&t->shard.match_ns, 0.99),
+           (unsigned long long)lat_quantile(&t->shard.match_ns, 0.999),
+           (unsigned long long)t->shard.match_ns.count);
+    uint64_t lookups = t->shard.cache_hits + t->shard.cache_misses;
+    if (lookups) {
+        printf("  verdict cache: %llu hits of %llu lookups (%.1f%%)\n", (unsigned long long)t->shard.cache_hits,
+               (unsigned long long)lookups, 100.0 * (double)t->shard.cache_hits / (double)lookups);
+    }
+}
+
+static void print_groups(const StatsHeader *h, const GroupCounters *groups, const GroupVerdicts *verdicts) {
+    printf("  %6s %6s %10s %12s %8s %8s %8s %10s %8s\n",
+           "group", "users", "forwarded", "pipe bytes", "blocked", "pauses", "removed", "violations", "state");
+    for (uint32_t g = 0; g < h->ngroups; g++) {
+        const GroupCounters *c = &groups[g];
+        printf("  %6u %6u %10llu %12llu %8llu %8llu %8llu %10llu %8s\n", g, c->users,
+               (unsigned long long)c->forwarded, (unsigned long long)c->bytes_read,
+               (unsigned long long)(c->send_blocked + c->ring_full), (unsigned long long)c->pauses,
+               (unsigned long long)c->removed, (unsigned long long)verdicts[g].violations,
+               c->done ? "done" : (c->users ? "running" : "-"));
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long interval_ms = 0;
+    int per_group = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "i:g")) != -1) {
+        switch (opt) {
+        case 'i': interval_ms = strtol(optarg, NULL, 10); break;
+        case 'g': per_group = 1; break;
+        default:
+            fprintf(stderr, "Usage: %s [-i interval_ms] [-g] <testcase_number>\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-i interval_ms] [-g] <testcase_number>\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    char input_file_path[128];
+    snprintf(input_file_path, sizeof(input_file_path), "./testcase_%s/input.txt", argv[optind]);
+    FILE *fp = fopen(input_file_path, "r");
+    int n, validation_key, app_key, moderator_key;
+    if (!fp || fscanf(fp, "%d %d %d %d", &n, &validation_key, &app_key, &moderator_key) != 4) {
+        fprintf(stderr, "Error reading %s\n", input_file_path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(fp);
+
+    StatsHeader *h = stats_attach(moderator_key, 0);
+    if (!h) {
+        fprintf(stderr, "No stats segment for moderator key %d (is moderator.out running?)\n", moderator_key);
+        exit(EXIT_FAILURE);
+    }
+
+    GroupCounters *groups = calloc(h->ngroups ? h->ngroups : 1, sizeof(GroupCounters));
+    GroupVerdicts *verdicts = calloc(h->ngroups ? h->ngroups : 1, sizeof(GroupVerdicts));
+    Totals *cur = malloc(sizeof(Totals)), *prev = malloc(sizeof(Totals));
+    if (!groups || !verdicts || !cur || !prev) {
+        perror("allocating");
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t then = stats_now_ns();
+    read_totals(h, cur, groups, verdicts);
+    print_totals(h, cur, NULL, 0);
+    if (per_group) print_groups(h, groups, verdicts);
+
+    /* The moderator unlinks the segment when it stops; our mapping stays valid,
+       so the pid tells us when to quit. */
+    while (interval_ms > 0 && kill((pid_t)h->moderator_pid, 0) == 0) {
+        usleep((useconds_t)interval_ms * 1000);
+        Totals *t = prev;
+        prev = cur;
+        cur = t;
+        uint64_t now = stats_now_ns();
+        read_totals(h, cur, groups, verdicts);
+        printf("\n");
+        print_totals(h, cur, prev, (now - then) / 1e9);
+        if (per_group) print_groups(h, groups, verdicts);
+        fflush(stdout);
+        then = now;
+    }
+
+    stats_detach(h);
+    return 0;
+}
@@ -0,0 +1,214 @@
+/***************************************************
+ * stats.h
+ *
+ * Run-time counters. Every group and every moderator shard counts into its
+ * own plain, cache-line-aligned struct on the hot path (no atomics, no
+ * sharing), and every STATS_INTERVAL_NS or so copies it into its slot of a
+ * shared memory segment, `/chatmod_stats_<moderator key>`. stats.out maps the
+ * segment read-only and prints it while the run goes on.
+ *
+ * Each slot is a seqlock: the writer makes `seq` odd, copies, and makes it
+ * even again; a reader retries until it sees the same even `seq` on both
+ * sides of its copy. The moderator creates the segment (it starts first
+ * anyway) and removes it on shutdown; groups attach if it is there and just
+ * keep counting locally if it is not.
+ *
+ * Pipe traffic is counted per group, summed over its users, not per pipe:
+ * slots are fixed-size and sized before any group knows how many users it
+ * has, and one group thread reads all of its pipes anyway, so a group's
+ * totals show whether its reading keeps up.
+ ***************************************************/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "latency.h"
+
+#define STATS_MAGIC 0x43535431u   /* "CST1" */
+#define STATS_INTERVAL_NS 100000000ull
+#define STATS_CACHELINE 64
+
+/* One group's view. Gauges (depths) are sampled when the slot is published. */
+typedef struct {
+    uint64_t forwarded;       /* chat messages handed on */
+    uint64_t bytes_read;      /* from all of its user pipes */
+    uint64_t reads;           /* readv() calls that returned data, over all its pipes */
+    uint64_t send_blocked;    /* msgsnd() found a queue full and had to wait */
+    uint64_t ring_full;       /* shm transport: waits for ring space */
+    uint64_t batches;         /* CHATMOD_BATCH: batches sent to the moderator */
+    uint64_t pauses;          /* user pipes paused because their ring filled */
+    uint64_t removed;         /* users removed by the moderator */
+    uint64_t throttled;       /* flow-control grants that came back empty */
+    uint64_t val_depth;       /* messages on the validation queue */
+    uint64_t mod_depth;       /* messages on the moderator queue */
+    uint32_t users;
+    uint32_t done;            /* 1 once the group has terminated */
+} GroupCounters;
+
+/* One moderator shard's view. */
+typedef struct {
+    uint64_t moderated;
+    uint64_t prefilter_rejects;  /* settled by the prefilter alone */
+    uint64_t violations;         /* filtered words counted */
+    uint64_t expired;            /* CHATMOD_WINDOW: violations that aged out of the window */
+    uint64_t removals;
+    uint64_t queue_depth;        /* this shard's queue plus its shm rings */
+    uint64_t idle_waits;         /* times the shard ran out of work (see waiter.h) */
+    uint64_t idle_blocks;        /* ... and slept on its doorbell rather than polling */
+    uint64_t cache_hits;         /* verdicts answered by the verdict cache */
+    uint64_t cache_misses;
+    LatencyHist match_ns;        /* time in prefilter + matcher, sampled */
+} ShardCounters;
+
+/* Moderator-side totals for one group, written by the shard that owns it. */
+typedef struct {
+    uint64_t violations;
+    uint64_t removals;
+} GroupVerdicts;
+
+typedef struct {
+    _Alignas(STATS_CACHELINE) _Atomic uint32_t seq;
+    uint64_t updated_ns;
+    GroupCounters c;
+} GroupSlot;
+
+typedef struct {
+    _Alignas(STATS_CACHELINE) _Atomic uint32_t seq;
+    uint64_t updated_ns;
+    ShardCounters c;
+    _Atomic uint32_t room;       /* free slots in the shard's queue, kept current for flow control */
+} ShardSlot;
+
+typedef struct {
+    _Atomic uint32_t magic;     /* set last by the creator */
+    uint32_t ngroups;
+    uint32_t nshards;
+    uint32_t moderator_pid;
+    uint64_t started_ns;
+    _Atomic uint32_t live_groups;   /* attached and not yet done; flow control splits room by it */
+    /* GroupSlot[ngroups], ShardSlot[nshards], GroupVerdicts[ngroups] follow */
+} StatsHeader;
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void stats_name(char *buf, size_t n, int key) {
+    snprintf(buf, n, "/chatmod_stats_%d", key);
+}
+
+static inline size_t stats_groups_offset(void) {
+    return (sizeof(StatsHeader) + STATS_CACHELINE - 1) & ~(size_t)(STATS_CACHELINE - 1);
+}
+
+static inline GroupSlot *stats_group(StatsHeader *h, uint32_t g) {
+    return (GroupSlot *)((char *)h + stats_groups_offset()) + g;
+}
+
+static inline ShardSlot *stats_shard(StatsHeader *h, uint32_t k) {
+    return (ShardSlot *)stats_group(h, h->ngroups) + k;
+}
+
+/* Covered by the owning shard's seqlock. */
+static inline GroupVerdicts *stats_verdicts(StatsHeader *h, uint32_t g) {
+    return (GroupVerdicts *)stats_shard(h, h->nshards) + g;
+}
+
+static inline size_t stats_bytes(uint32_t ngroups, uint32_t nshards) {
+    return stats_groups_offset() + ngroups * sizeof(GroupSlot) + nshards * sizeof(ShardSlot) +
+           ngroups * sizeof(GroupVerdicts);
+}
+
+/* Moderator: (re)create the segment, all counters zero. */
+static inline StatsHeader *stats_create(int key, uint32_t ngroups, uint32_t nshards) {
+    char name[64];
+    stats_name(name, sizeof(name), key);
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd < 0) return NULL;
+    size_t bytes = stats_bytes(ngroups, nshards);
+    if (ftruncate(fd, (off_t)bytes) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    StatsHeader *h = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    h->ngroups = ngroups;
+    h->nshards = nshards;
+    h->moderator_pid = (uint32_t)getpid();
+    h->started_ns = stats_now_ns();
+    atomic_store_explicit(&h->magic, STATS_MAGIC, memory_order_release);
+    return h;
+}
+
+/* Groups map it read-write, stats.out read-only. NULL if it is missing or not ready. */
+static inline StatsHeader *stats_attach(int key, int writable) {
+    char name[64];
+    stats_name(name, sizeof(name), key);
+    int fd = shm_open(name, writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(StatsHeader)) {
+        close(fd);
+        return NULL;
+    }
+    StatsHeader *h = mmap(NULL, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                          MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return NULL;
+    if (atomic_load_explicit(&h->magic, memory_order_acquire) != STATS_MAGIC ||
+        stats_bytes(h->ngroups, h->nshards) > (size_t)st.st_size) {
+        munmap(h, (size_t)st.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+static inline void stats_detach(StatsHeader *h) {
+    munmap(h, stats_bytes(h->ngroups, h->nshards));
+}
+
+static inline void stats_destroy(StatsHeader *h, int key) {
+    char name[64];
+    stats_name(name, sizeof(name), key);
+    stats_detach(h);
+    shm_unlink(name);
+}
+
+static inline void stats_write_begin(_Atomic uint32_t *seq) {
+    atomic_fetch_add_explicit(seq, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void stats_write_end(_Atomic uint32_t *seq) {
+    atomic_fetch_add_explicit(seq, 1, memory_order_release);
+}
+
+/* Copy `n` bytes published under `seq` into dst; retries while a write is in flight. */
+static inline void stats_read(const _Atomic uint32_t *seq, void *dst, const void *src, size_t n) {
+    while (1) {
+        uint32_t before = atomic_load_explicit(seq, memory_order_acquire);
+        if (before & 1) continue;
+        memcpy(dst, src, n);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(seq, memory_order_relaxed) == before) return;
+    }
+}
+
+#endif /* STATS_H */
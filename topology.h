@@ -0,0 +1,227 @@
+/***************************************************
+ * topology.h
+ *
+ * CPU placement for CHATMOD_PIN=on. The topology comes from sysfs: for each
+ * CPU this process may run on, its package, its physical core (the lowest
+ * CPU among its SMT siblings) and its cache domain (the lowest CPU sharing
+ * its last-level cache, which is a core complex on chiplet parts and a
+ * socket elsewhere).
+ *
+ * The moderator gets the last CHATMOD_PIN_MODERATOR whole cores, siblings
+ * included, so nothing else is scheduled next to its shards. The rest is
+ * split by cache domain, and group g runs on the CPUs of domain g mod
+ * domains, together with the users it forks, so a group's pipes and its
+ * merge stay within one cache. app.out and the moderator each compute the
+ * same split from the same sysfs, so they agree without talking.
+ *
+ * Hosts with a single core have nothing to reserve; the moderator then
+ * shares it with the groups.
+ ***************************************************/
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/* cpu_set_t and the affinity calls need _GNU_SOURCE, defined by the including
+   .c file ahead of its first system header. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <sched.h>
+
+#include "config.h"
+
+typedef struct {
+    int cpu;
+    int package;
+    int core;                      /* lowest CPU of its SMT siblings */
+    int domain;                    /* lowest CPU sharing its last-level cache */
+} TopoCpu;
+
+typedef struct {
+    TopoCpu *cpus;                 /* sorted by domain, core, cpu */
+    int ncpus;
+    int ncores;
+    int npackages;
+    int ndomains;
+} Topology;
+
+/* The first number in a sysfs file (a plain id, or the start of a CPU list); `def` if unreadable. */
+static inline int topo_read_int(const char *path, int def) {
+    FILE *f = fopen(path, "r");
+    if (!f) return def;
+    int v;
+    if (fscanf(f, "%d", &v) != 1) v = def;
+    fclose(f);
+    return v;
+}
+
+/* The cache domain of `cpu`: the sharers of its highest-level data or unified cache. */
+static inline int topo_cache_domain(int cpu, int def) {
+    int best_level = 0, domain = def;
+    for (int i = 0; i < 16; i++) {
+        char path[128], type[32] = "";
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/type", cpu, i);
+        FILE *f = fopen(path, "r");
+        if (!f) break;
+        int ok = fscanf(f, "%31s", type) == 1;
+        fclose(f);
+        if (!ok || strcmp(type, "Instruction") == 0) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/level", cpu, i);
+        int level = topo_read_int(path, 0);
+        if (level <= best_level) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cache/index%d/shared_cpu_list", cpu, i);
+        int first = topo_read_int(path, -1);
+        if (first < 0) continue;
+        best_level = level;
+        domain = first;
+    }
+    return domain;
+}
+
+static inline int topo_cmp(const void *a, const void *b) {
+    const TopoCpu *x = a, *y = b;
+    if (x->domain != y->domain) return x->domain < y->domain ? -1 : 1;
+    if (x->core != y->core) return x->core < y->core ? -1 : 1;
+    return (x->cpu > y->cpu) - (x->cpu < y->cpu);
+}
+
+/* Count distinct values of one field over the sorted CPUs. */
+static inline int topo_distinct(const Topology *t, size_t field) {
+    int n = 0;
+    for (int i = 0; i < t->ncpus; i++) {
+        int v = *(const int *)((const char *)&t->cpus[i] + field);
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++) seen = *(const int *)((const char *)&t->cpus[j] + field) == v;
+        n += !seen;
+    }
+    return n;
+}
+
+/* Read the topology of the CPUs in this process's affinity mask. Returns 0, or -1. */
+static inline int topo_load(Topology *t) {
+    memset(t, 0, sizeof(*t));
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return -1;
+    int n = CPU_COUNT(&allowed);
+    t->cpus = calloc(n > 0 ? n : 1, sizeof(TopoCpu));
+    if (!t->cpus) return -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE && t->ncpus < n; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        char path[128];
+        TopoCpu *c = &t->cpus[t->ncpus++];
+        c->cpu = cpu;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        c->package = topo_read_int(path, 0);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        c->core = topo_read_int(path, cpu);
+        c->domain = topo_cache_domain(cpu, c->package);
+    }
+    qsort(t->cpus, t->ncpus, sizeof(TopoCpu), topo_cmp);
+    t->ncores = topo_distinct(t, offsetof(TopoCpu, core));
+    t->npackages = topo_distinct(t, offsetof(TopoCpu, package));
+    t->ndomains = topo_distinct(t, offsetof(TopoCpu, domain));
+    return 0;
+}
+
+static inline void topo_free(Topology *t) {
+    free(t->cpus);
+    memset(t, 0, sizeof(*t));
+}
+
+static inline int topo_pinning(void) {
+    return env_is("CHATMOD_PIN", "on");
+}
+
+/* Where everything goes: the moderator's CPUs and those left for groups. */
+typedef struct {
+    cpu_set_t moderator;
+    cpu_set_t groups;
+    int shared;                    /* nothing could be reserved; both get every CPU */
+} Placement;
+
+static inline void topo_place(const Topology *t, Placement *p) {
+    CPU_ZERO(&p->moderator);
+    CPU_ZERO(&p->groups);
+    long want = env_long("CHATMOD_PIN_MODERATOR", (t->ncores + 3) / 4);
+    if (want < 1) want = 1;
+    /* Whole cores from the end of the order, so the groups keep the first domains intact. */
+    int cores = 0, last_core = -1;
+    for (int i = t->ncpus - 1; i >= 0; i--) {
+        const TopoCpu *c = &t->cpus[i];
+        if (c->core != last_core) {
+            if (cores == want || cores == t->ncores - 1) break;
+            cores++;
+            last_core = c->core;
+        }
+        CPU_SET(c->cpu, &p->moderator);
+    }
+    for (int i = 0; i < t->ncpus; i++) {
+        if (!CPU_ISSET(t->cpus[i].cpu, &p->moderator)) CPU_SET(t->cpus[i].cpu, &p->groups);
+    }
+    p->shared = CPU_COUNT(&p->moderator) == 0 || CPU_COUNT(&p->groups) == 0;
+    if (p->shared) {
+        for (int i = 0; i < t->ncpus; i++) {
+            CPU_SET(t->cpus[i].cpu, &p->moderator);
+            CPU_SET(t->cpus[i].cpu, &p->groups);
+        }
+    }
+}
+
+/* The cache domains that have group CPUs, in order; returns how many (at most `max`). */
+static inline int topo_group_domains(const Topology *t, const Placement *p, int *domains, int max) {
+    int n = 0;
+    for (int i = 0; i < t->ncpus && n < max; i++) {
+        const TopoCpu *c = &t->cpus[i];
+        if (CPU_ISSET(c->cpu, &p->groups) && (n == 0 || domains[n - 1] != c->domain)) domains[n++] = c->domain;
+    }
+    return n;
+}
+
+/* The CPUs of group g: the group CPUs of cache domain `domains[g % n]`. */
+static inline void topo_group_cpus(const Topology *t, const Placement *p, const int *domains, int n,
+                                   int g, cpu_set_t *out) {
+    CPU_ZERO(out);
+    if (n <= 0) return;
+    int domain = domains[g % n];
+    for (int i = 0; i < t->ncpus; i++) {
+        const TopoCpu *c = &t->cpus[i];
+        if (c->domain == domain && CPU_ISSET(c->cpu, &p->groups)) CPU_SET(c->cpu, out);
+    }
+}
+
+/* The k-th CPU of a set, wrapping around; -1 if it is empty. */
+static inline int topo_nth_cpu(const cpu_set_t *set, int k) {
+    int n = CPU_COUNT(set);
+    if (n == 0) return -1;
+    k %= n;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, set) && k-- == 0) return cpu;
+    }
+    return -1;
+}
+
+/* A set as a sysfs-style CPU list ("0-3,8"). */
+static inline const char *topo_format(const cpu_set_t *set, char *buf, size_t size) {
+    size_t used = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && used < size; cpu++) {
+        if (!CPU_ISSET(cpu, set)) continue;
+        int end = cpu;
+        while (end + 1 < CPU_SETSIZE && CPU_ISSET(end + 1, set)) end++;
+        int w = end > cpu ? snprintf(buf + used, size - used, "%s%d-%d", used ? "," : "", cpu, end)
+                          : snprintf(buf + used, size - used, "%s%d", used ? "," : "", cpu);
+        if (w < 0) break;
+        used += (size_t)w;
+        cpu = end;
+    }
+    return buf;
+}
+
+static inline void topo_print(const Topology *t, const Placement *p, const char *who) {
+    char mod[256];
+    fprintf(stderr, "%s: %d cpus, %d cores, %d packages, %d cache domains; moderator on cpus %s%s\n", who,
+            t->ncpus, t->ncores, t->npackages, t->ndomains, topo_format(&p->moderator, mod, sizeof(mod)),
+            p->shared ? " (shared with groups: no core to spare)" : "");
+}
+
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,330 @@
+/***************************************************
+ * trace.h
+ *
+ * Binary traces of the chat messages a group forwards (CHATMOD_TRACE_RECORD),
+ * which a later run can replay in place of the user files
+ * (CHATMOD_TRACE_REPLAY). Each group writes its own file,
+ * `<dir>/group_<g>.trace`:
+ *
+ *   TraceHeader
+ *   blocks: TraceBlock + payload, the payload lz.h-compressed unless that did
+ *           not make it smaller
+ *   uint32_t counts[nusers]   messages recorded per user
+ *   TraceFooter
+ *
+ * A block holds up to TRACE_BLOCK bytes of records, each encoded as varints:
+ * user, timestamp (zigzag delta from the previous record), microseconds since
+ * the previous record, text length, then the text. Deltas restart in every
+ * block, so blocks decode on their own. The footer is written last; a trace
+ * whose recording did not finish has none and is refused.
+ ***************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lz.h"
+
+#define TRACE_MAGIC 0x43545231u          /* "CTR1" */
+#define TRACE_FOOTER_MAGIC 0x43545246u   /* "CTRF" */
+#define TRACE_BLOCK (64 * 1024)          /* raw record bytes per block */
+#define TRACE_RECORD_MAX (4 * 5 + 65535) /* four varints and the longest text */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t group;
+    uint32_t nusers;
+    uint32_t pad;
+} TraceHeader;
+
+typedef struct {
+    uint32_t raw_len;
+    uint32_t stored_len;      /* == raw_len: stored uncompressed */
+    uint32_t nrecords;
+    uint32_t check;           /* trace_check() of the stored payload */
+} TraceBlock;
+
+typedef struct {
+    uint64_t nrecords;
+    uint32_t nusers;
+    uint32_t magic;
+} TraceFooter;
+
+typedef struct {
+    int user;
+    int timestamp;
+    uint64_t at_us;           /* since recording started */
+    const char *text;         /* valid until the next trace_next(); not terminated */
+    uint16_t len;
+} TraceRecord;
+
+typedef struct {
+    int fd;
+    uint32_t nusers;
+    uint32_t *counts;
+    uint64_t nrecords;
+    uint64_t started_ns;
+    uint8_t *raw;             /* block being filled */
+    uint8_t *packed;          /* compression output */
+    size_t used;
+    uint32_t block_records;
+    int prev_timestamp;
+    uint64_t prev_us;
+} TraceWriter;
+
+typedef struct {
+    int fd;
+    TraceHeader header;
+    uint32_t *counts;
+    uint64_t nrecords;
+    off_t pos;                /* next block */
+    off_t data_end;           /* where the counts begin */
+    uint8_t *raw;             /* current block, decoded */
+    uint8_t *packed;
+    size_t used, len;
+    uint32_t block_left;      /* records still to decode in this block */
+    int prev_timestamp;
+    uint64_t at_us;
+} TraceReader;
+
+static inline uint64_t trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint32_t trace_check(const uint8_t *p, size_t n) {
+    uint32_t h = 2166136261u ^ TRACE_MAGIC;
+    for (size_t i = 0; i < n; i++) h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static inline uint8_t *trace_put_varint(uint8_t *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Returns 0, or -1 if the varint runs past `end` or is too long. */
+static inline int trace_get_varint(const uint8_t **p, const uint8_t *end, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*p >= end) return -1;
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static inline int trace_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+static inline int trace_read_at(int fd, void *data, size_t len, off_t off) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t r = pread(fd, p, len, off);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            if (r == 0) errno = EIO;
+            return -1;
+        }
+        p += r;
+        len -= (size_t)r;
+        off += r;
+    }
+    return 0;
+}
+
+/* Start recording to `path` for a group of `nusers` users. Returns 0, or -1 with errno set. */
+static inline int trace_create(TraceWriter *w, const char *path, uint32_t group, uint32_t nusers) {
+    memset(w, 0, sizeof(*w));
+    w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w->fd < 0) return -1;
+    w->nusers = nusers;
+    w->counts = calloc(nusers > 0 ? nusers : 1, sizeof(uint32_t));
+    w->raw = malloc(TRACE_BLOCK + TRACE_RECORD_MAX);
+    w->packed = malloc(TRACE_BLOCK + TRACE_RECORD_MAX);
+    if (!w->counts || !w->raw || !w->packed) return -1;
+    w->started_ns = trace_now_ns();
+    TraceHeader h = { TRACE_MAGIC, group, nusers, 0 };
+    return trace_write_all(w->fd, &h, sizeof(h));
+}
+
+/* Compress and write the block being filled, if it has anything in it. */
+static inline int trace_flush_block(TraceWriter *w) {
+    if (w->block_records == 0) return 0;
+    size_t packed = lz_compress(w->raw, w->used, w->packed, w->used - 1);
+    const uint8_t *payload = packed ? w->packed : w->raw;
+    size_t stored = packed ? packed : w->used;
+    TraceBlock b = { (uint32_t)w->used, (uint32_t)stored, w->block_records, trace_check(payload, stored) };
+    if (trace_write_all(w->fd, &b, sizeof(b)) < 0 || trace_write_all(w->fd, payload, stored) < 0) return -1;
+    w->used = 0;
+    w->block_records = 0;
+    w->prev_timestamp = 0;
+    return 0;
+}
+
+/* Record one forwarded message. Returns 0, or -1 with errno set. */
+static inline int trace_append(TraceWriter *w, int user, int timestamp, const char *text, uint16_t len) {
+    if (user < 0 || (uint32_t)user >= w->nusers) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint64_t now_us = (trace_now_ns() - w->started_ns) / 1000;
+    if (w->block_records == 0) w->prev_us = 0;
+    uint8_t *p = w->raw + w->used;
+    int64_t delta = (int64_t)timestamp - w->prev_timestamp;
+    p = trace_put_varint(p, (uint64_t)user);
+    p = trace_put_varint(p, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    /* The first record of a block carries the absolute time. */
+    p = trace_put_varint(p, now_us - w->prev_us);
+    p = trace_put_varint(p, len);
+    memcpy(p, text, len);
+    w->used = (size_t)(p + len - w->raw);
+    w->block_records++;
+    w->prev_timestamp = timestamp;
+    w->prev_us = now_us;
+    w->counts[user]++;
+    w->nrecords++;
+    return w->used >= TRACE_BLOCK ? trace_flush_block(w) : 0;
+}
+
+static inline void trace_writer_free(TraceWriter *w) {
+    if (w->fd >= 0) close(w->fd);
+    free(w->counts);
+    free(w->raw);
+    free(w->packed);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+/* Write the last block and the footer, and close. Returns 0, or -1 with errno set. */
+static inline int trace_finish(TraceWriter *w) {
+    TraceFooter f = { w->nrecords, w->nusers, TRACE_FOOTER_MAGIC };
+    int rc = 0;
+    if (trace_flush_block(w) < 0 || trace_write_all(w->fd, w->counts, w->nusers * sizeof(uint32_t)) < 0 ||
+        trace_write_all(w->fd, &f, sizeof(f)) < 0) {
+        rc = -1;
+    }
+    int saved = errno;
+    trace_writer_free(w);
+    errno = saved;
+    return rc;
+}
+
+static inline void trace_reader_free(TraceReader *r) {
+    if (r->fd >= 0) close(r->fd);
+    free(r->counts);
+    free(r->raw);
+    free(r->packed);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+/* Open a finished trace. Returns 0, or -1 with errno set (EINVAL: not a complete trace). */
+static inline int trace_open(TraceReader *r, const char *path) {
+    memset(r, 0, sizeof(*r));
+    r->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (r->fd < 0) return -1;
+    struct stat st;
+    TraceFooter f;
+    if (fstat(r->fd, &st) < 0) goto fail;
+    if ((size_t)st.st_size < sizeof(TraceHeader) + sizeof(TraceFooter) ||
+        trace_read_at(r->fd, &r->header, sizeof(r->header), 0) < 0 ||
+        trace_read_at(r->fd, &f, sizeof(f), st.st_size - (off_t)sizeof(f)) < 0) {
+        errno = EINVAL;
+        goto fail;
+    }
+    r->data_end = st.st_size - (off_t)sizeof(f) - (off_t)f.nusers * (off_t)sizeof(uint32_t);
+    if (r->header.magic != TRACE_MAGIC || f.magic != TRACE_FOOTER_MAGIC || f.nusers != r->header.nusers ||
+        r->data_end < (off_t)sizeof(TraceHeader)) {
+        errno = EINVAL;
+        goto fail;
+    }
+    r->counts = calloc(f.nusers > 0 ? f.nusers : 1, sizeof(uint32_t));
+    r->raw = malloc(TRACE_BLOCK + TRACE_RECORD_MAX);
+    r->packed = malloc(TRACE_BLOCK + TRACE_RECORD_MAX);
+    if (!r->counts || !r->raw || !r->packed) goto fail;
+    if (trace_read_at(r->fd, r->counts, f.nusers * sizeof(uint32_t), r->data_end) < 0) goto fail;
+    r->nrecords = f.nrecords;
+    r->pos = sizeof(TraceHeader);
+    return 0;
+fail:;
+    int saved = errno;
+    trace_reader_free(r);
+    errno = saved;
+    return -1;
+}
+
+/* Read and decode the next block. Returns 1, 0 at the end, -1 if it is damaged. */
+static inline int trace_load_block(TraceReader *r) {
+    if (r->pos >= r->data_end) return 0;
+    TraceBlock b;
+    if (r->data_end - r->pos < (off_t)sizeof(b) || trace_read_at(r->fd, &b, sizeof(b), r->pos) < 0) return -1;
+    r->pos += sizeof(b);
+    if (b.raw_len > TRACE_BLOCK + TRACE_RECORD_MAX || b.stored_len > b.raw_len ||
+        r->data_end - r->pos < (off_t)b.stored_len) {
+        return -1;
+    }
+    uint8_t *dst = b.stored_len == b.raw_len ? r->raw : r->packed;
+    if (trace_read_at(r->fd, dst, b.stored_len, r->pos) < 0 || trace_check(dst, b.stored_len) != b.check) return -1;
+    r->pos += b.stored_len;
+    if (dst == r->packed && lz_decompress(r->packed, b.stored_len, r->raw, b.raw_len) != (long)b.raw_len) return -1;
+    r->used = 0;
+    r->len = b.raw_len;
+    r->block_left = b.nrecords;
+    r->prev_timestamp = 0;
+    return 1;
+}
+
+/* Next record. Returns 1, 0 at the end of the trace, -1 if it is damaged. */
+static inline int trace_next(TraceReader *r, TraceRecord *rec) {
+    while (r->block_left == 0) {
+        int got = trace_load_block(r);
+        if (got <= 0) return got;
+    }
+    const uint8_t *p = r->raw + r->used, *end = r->raw + r->len;
+    uint64_t user, zz, dt, len;
+    if (trace_get_varint(&p, end, &user) < 0 || trace_get_varint(&p, end, &zz) < 0 ||
+        trace_get_varint(&p, end, &dt) < 0 || trace_get_varint(&p, end, &len) < 0 ||
+        user >= r->header.nusers || len > UINT16_MAX || (uint64_t)(end - p) < len) {
+        return -1;
+    }
+    int64_t delta = (int64_t)(zz >> 1) ^ -(int64_t)(zz & 1);
+    r->prev_timestamp = (int)(r->prev_timestamp + delta);
+    /* Block boundaries restart the time deltas from the absolute time. */
+    r->at_us = (r->used == 0 ? 0 : r->at_us) + dt;
+    rec->user = (int)user;
+    rec->timestamp = r->prev_timestamp;
+    rec->at_us = r->at_us;
+    rec->text = (const char *)p;
+    rec->len = (uint16_t)len;
+    r->used = (size_t)(p + len - r->raw);
+    r->block_left--;
+    return 1;
+}
+
+static inline void trace_close(TraceReader *r) {
+    trace_reader_free(r);
+}
+
+#endif /* TRACE_H */
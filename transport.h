@@ -0,0 +1,169 @@
+/***************************************************
+ * transport.h
+ *
+ * Optional shared-memory path from groups to the moderator
+ * (CHATMOD_TRANSPORT=shm). The moderator creates one POSIX shared memory
+ * segment named after the moderator key holding an SPSC ring per group and
+ * one doorbell per moderator shard; group g produces into ring g, and shard
+ * g % nshards consumes it. A message then costs one memcpy into the ring,
+ * and a futex wake only when the shard was idle.
+ *
+ * Validation still gets every message over System V, which is what the
+ * prebuilt validation.out reads.
+ *
+ * Decisions go the other way over a per-group FIFO (the control channel),
+ * whatever the transport: the group creates it and watches it with epoll
+ * next to its user pipes, the moderator writes fixed-size records into it.
+ ***************************************************/
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "spsc.h"
+
+#define SHM_MAGIC 0x43484d31u   /* "CHM1" */
+#define SHM_MAX_SHARDS 256
+
+typedef struct {
+    _Alignas(SPSC_CACHELINE) Doorbell bell;
+} ShmShard;
+
+typedef struct {
+    _Atomic uint32_t magic;     /* set last by the creator */
+    uint32_t ngroups;
+    uint32_t nshards;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint64_t ring_stride;       /* bytes between consecutive rings */
+    ShmShard shards[SHM_MAX_SHARDS];
+    /* rings follow, each starting on a cache line */
+} ShmHeader;
+
+static inline void shm_transport_name(char *buf, size_t n, int key) {
+    snprintf(buf, n, "/chatmod_%d", key);
+}
+
+static inline size_t shm_transport_bytes(const ShmHeader *h) {
+    return sizeof(ShmHeader) + (size_t)h->ngroups * h->ring_stride;
+}
+
+static inline SpscRing *shm_transport_ring(ShmHeader *h, uint32_t group) {
+    return (SpscRing *)((char *)h + sizeof(ShmHeader) + (size_t)group * h->ring_stride);
+}
+
+static inline Doorbell *shm_transport_bell(ShmHeader *h, uint32_t shard) {
+    return &h->shards[shard].bell;
+}
+
+/* Moderator: (re)create the segment. `slots` must be a power of two. */
+static inline ShmHeader *shm_transport_create(int key, uint32_t ngroups, uint32_t nshards,
+                                              uint32_t slots, uint32_t slot_size) {
+    char name[64];
+    shm_transport_name(name, sizeof(name), key);
+    shm_unlink(name);  /* drop a stale segment from an earlier run */
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0666);
+    if (fd < 0) return NULL;
+
+    ShmHeader tmp = { .ngroups = ngroups, .nshards = nshards, .slots = slots, .slot_size = slot_size };
+    size_t stride = spsc_bytes(slots, slot_size);
+    tmp.ring_stride = (stride + SPSC_CACHELINE - 1) & ~(size_t)(SPSC_CACHELINE - 1);
+    size_t bytes = shm_transport_bytes(&tmp);
+
+    if (ftruncate(fd, (off_t)bytes) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    ShmHeader *h = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+    h->ngroups = ngroups;
+    h->nshards = nshards;
+    h->slots = slots;
+    h->slot_size = slot_size;
+    h->ring_stride = tmp.ring_stride;
+    for (uint32_t g = 0; g < ngroups; g++) {
+        spsc_init(shm_transport_ring(h, g), slots, slot_size);
+    }
+    atomic_store_explicit(&h->magic, SHM_MAGIC, memory_order_release);
+    return h;
+}
+
+/* Group: map the segment the moderator created. NULL if it is missing or not ready. */
+static inline ShmHeader *shm_transport_attach(int key) {
+    char name[64];
+    shm_transport_name(name, sizeof(name), key);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmHeader)) {
+        close(fd);
+        return NULL;
+    }
+    ShmHeader *h = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) return NULL;
+    if (atomic_load_explicit(&h->magic, memory_order_acquire) != SHM_MAGIC ||
+        shm_transport_bytes(h) > (size_t)st.st_size) {
+        munmap(h, (size_t)st.st_size);
+        return NULL;
+    }
+    return h;
+}
+
+static inline void shm_transport_destroy(ShmHeader *h, int key) {
+    char name[64];
+    shm_transport_name(name, sizeof(name), key);
+    munmap(h, shm_transport_bytes(h));
+    shm_unlink(name);
+}
+
+/* Path of group g's control FIFO. */
+static inline void control_fifo_path(char *buf, size_t n, int key, int group) {
+    snprintf(buf, n, "/tmp/chatmod_%d_%d.ctl", key, group);
+}
+
+/* Group: create the FIFO and open it for reading. Opened O_RDWR so that it
+   never reports EOF/HUP while no moderator has it open. */
+static inline int control_fifo_create(int key, int group) {
+    char path[128];
+    control_fifo_path(path, sizeof(path), key, group);
+    unlink(path);
+    if (mkfifo(path, 0666) < 0) return -1;
+    return open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+}
+
+/* Moderator: open group g's FIFO for writing; -1 if the group is not listening. */
+static inline int control_fifo_open(int key, int group) {
+    char path[128];
+    control_fifo_path(path, sizeof(path), key, group);
+    return open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static inline void control_fifo_remove(int key, int group) {
+    char path[128];
+    control_fifo_path(path, sizeof(path), key, group);
+    unlink(path);
+}
+
+/* Lift the soft open-file limit to the hard one. Every user pipe and control
+   FIFO is a descriptor, and large testcases go well past the usual 1024. */
+static inline void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+#endif /* TRANSPORT_H */
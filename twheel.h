@@ -0,0 +1,161 @@
+/***************************************************
+ * twheel.h
+ *
+ * A hierarchical timer wheel for expiring windowed violation counts
+ * (CHATMOD_WINDOW). Time is whatever the caller advances it by; the moderator
+ * uses message timestamps, so a wheel only ever moves forward and may jump by
+ * millions of ticks at once.
+ *
+ * TW_LEVELS wheels of TW_SLOTS slots each. A timer goes on the level of the
+ * highest 6-bit digit in which its expiry differs from the wheel's clock, in
+ * the slot of that digit. Advancing the clock collects, level by level, only
+ * the slots whose digit the clock passed - a bit mask per level says which
+ * slots hold anything, so that is a few word operations when little is due -
+ * and re-files what it collected: due timers fire, the rest drop to a lower
+ * level. A timer is re-filed at most TW_LEVELS times, so expiry is O(1)
+ * amortized whatever the jump.
+ *
+ * Timers live in a TimerPool shared by the wheels of one thread and are
+ * linked by index. Not thread-safe.
+ ***************************************************/
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TW_BITS 6
+#define TW_SLOTS (1u << TW_BITS)
+#define TW_LEVELS 6                  /* 36 bits of clock: any int32 timestamp plus a window */
+#define TW_NIL UINT32_MAX
+
+typedef struct {
+    uint64_t expires;
+    uint64_t key;
+    int32_t amount;
+    uint32_t next;                   /* in its slot, or in the pool's free list */
+} Timer;
+
+typedef struct {
+    Timer *timers;
+    uint32_t cap;
+    uint32_t free;                   /* free list head */
+} TimerPool;
+
+typedef struct {
+    uint64_t now;
+    uint32_t count;                  /* timers on the wheel */
+    uint64_t occupied[TW_LEVELS];    /* bit s: slot s is non-empty */
+    uint32_t head[TW_LEVELS][TW_SLOTS];
+} TimerWheel;
+
+static inline void tw_pool_init(TimerPool *p) {
+    p->timers = NULL;
+    p->cap = 0;
+    p->free = TW_NIL;
+}
+
+/* A timer to fill in, TW_NIL if out of memory. Indices stay valid as the pool grows. */
+static inline uint32_t tw_alloc(TimerPool *p) {
+    if (p->free == TW_NIL) {
+        uint32_t cap = p->cap ? 2 * p->cap : 1024;
+        Timer *t = realloc(p->timers, (size_t)cap * sizeof(Timer));
+        if (!t) return TW_NIL;
+        for (uint32_t i = p->cap; i < cap; i++) t[i].next = i + 1 < cap ? i + 1 : TW_NIL;
+        p->timers = t;
+        p->free = p->cap;
+        p->cap = cap;
+    }
+    uint32_t i = p->free;
+    p->free = p->timers[i].next;
+    return i;
+}
+
+static inline void tw_release(TimerPool *p, uint32_t i) {
+    p->timers[i].next = p->free;
+    p->free = i;
+}
+
+static inline void tw_pool_free(TimerPool *p) {
+    free(p->timers);
+    tw_pool_init(p);
+}
+
+static inline void tw_init(TimerWheel *w, uint64_t now) {
+    memset(w, 0, sizeof(*w));
+    memset(w->head, 0xff, sizeof(w->head));
+    w->now = now;
+}
+
+static inline void tw_file(TimerWheel *w, TimerPool *p, uint32_t i) {
+    uint64_t expires = p->timers[i].expires;
+    int level = (63 - __builtin_clzll(expires ^ w->now)) / TW_BITS;
+    uint32_t slot = (uint32_t)(expires >> (level * TW_BITS)) & (TW_SLOTS - 1);
+    p->timers[i].next = w->head[level][slot];
+    w->head[level][slot] = i;
+    w->occupied[level] |= 1ull << slot;
+}
+
+/* Put timer `i` (expiry, key and amount filled in) on the wheel. Returns 0, or 1 if
+   it is already due; then it is not added and stays the caller's. */
+static inline int tw_add(TimerWheel *w, TimerPool *p, uint32_t i) {
+    if (p->timers[i].expires <= w->now) return 1;
+    tw_file(w, p, i);
+    w->count++;
+    return 0;
+}
+
+/* Move the clock to `now`, calling fire(ctx, timer) for every timer that falls due;
+   fired timers go back to the pool. A clock that would go backwards stays put. */
+static inline void tw_advance(TimerWheel *w, TimerPool *p, uint64_t now,
+                              void (*fire)(void *ctx, const Timer *t), void *ctx) {
+    if (now <= w->now) return;
+    if (w->count == 0) {
+        w->now = now;
+        return;
+    }
+    uint32_t collected = TW_NIL;
+    for (int level = 0; level < TW_LEVELS; level++) {
+        uint64_t from = w->now >> (level * TW_BITS), to = now >> (level * TW_BITS);
+        if (from == to) break;   /* and so on every level above */
+        /* The slots whose digit the clock passed: (from, to] on this level. */
+        uint64_t passed;
+        if (to - from >= TW_SLOTS) {
+            passed = ~0ull;
+        } else {
+            uint32_t n = (uint32_t)(to - from);
+            uint32_t start = (uint32_t)(from + 1) & (TW_SLOTS - 1);
+            uint64_t run = (1ull << n) - 1;
+            passed = (run << start) | (start ? run >> (TW_SLOTS - start) : 0);
+        }
+        uint64_t due = passed & w->occupied[level];
+        w->occupied[level] &= ~due;
+        while (due) {
+            uint32_t slot = (uint32_t)__builtin_ctzll(due);
+            due &= due - 1;
+            uint32_t i = w->head[level][slot];
+            w->head[level][slot] = TW_NIL;
+            while (i != TW_NIL) {
+                uint32_t next = p->timers[i].next;
+                p->timers[i].next = collected;
+                collected = i;
+                i = next;
+            }
+        }
+    }
+    w->now = now;
+    while (collected != TW_NIL) {
+        uint32_t i = collected;
+        collected = p->timers[i].next;
+        if (p->timers[i].expires <= now) {
+            fire(ctx, &p->timers[i]);
+            tw_release(p, i);
+            w->count--;
+        } else {
+            tw_file(w, p, i);
+        }
+    }
+}
+
+#endif /* TWHEEL_H */
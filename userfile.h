@@ -0,0 +1,124 @@
+/***************************************************
+ * userfile.h
+ *
+ * Reads a user's message file ("<timestamp> <text>" per line) straight out
+ * of a read-only mapping. Each line comes back as a view: the timestamp plus
+ * a pointer/length into the mapping, so the text is never copied on its way
+ * in. Pages behind the read position can be handed back with
+ * userfile_release(), which keeps RSS flat on very large replay files.
+ ***************************************************/
+#ifndef USERFILE_H
+#define USERFILE_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define USERFILE_MAX_TEXT 255           /* longest text kept; longer tokens are cut */
+#define USERFILE_RELEASE_CHUNK (1 << 20) /* give back consumed pages in steps of this */
+
+typedef struct {
+    const char *data;   /* NULL for an empty file */
+    size_t size;
+    size_t pos;         /* next byte to parse */
+    size_t released;    /* bytes before this are no longer mapped in */
+} UserFile;
+
+typedef struct {
+    int timestamp;
+    const char *text;   /* points into the mapping, not terminated */
+    uint16_t len;
+} UserLine;
+
+/* Returns 0 on success, -1 with errno set. */
+static inline int userfile_open(UserFile *uf, const char *path) {
+    uf->data = NULL;
+    uf->size = uf->pos = uf->released = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size > 0) {
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+        uf->data = p;
+        uf->size = (size_t)st.st_size;
+    }
+    close(fd);
+    return 0;
+}
+
+static inline void userfile_close(UserFile *uf) {
+    if (uf->data) munmap((void *)uf->data, uf->size);
+    uf->data = NULL;
+    uf->size = uf->pos = uf->released = 0;
+}
+
+static inline int userfile_space(char c) {
+    return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+/* Next "<int> <token>" pair, with the same whitespace rules as fscanf("%d %s").
+   Returns 1 and fills `line`, or 0 at end of file or on a malformed line. */
+static inline int userfile_next(UserFile *uf, UserLine *line) {
+    const char *p = uf->data + uf->pos;
+    const char *end = uf->data + uf->size;
+    if (!uf->data) return 0;
+
+    while (p < end && userfile_space(*p)) p++;
+    int neg = 0;
+    if (p < end && (*p == '-' || *p == '+')) neg = (*p++ == '-');
+    if (p == end || *p < '0' || *p > '9') {
+        uf->pos = uf->size;
+        return 0;
+    }
+    /* A timestamp that does not fit in an int is a malformed line. */
+    int64_t ts = 0, limit = neg ? -(int64_t)INT_MIN : INT_MAX;
+    while (p < end && *p >= '0' && *p <= '9') {
+        ts = ts * 10 + (*p++ - '0');
+        if (ts > limit) {
+            uf->pos = uf->size;
+            return 0;
+        }
+    }
+
+    while (p < end && userfile_space(*p)) p++;
+    const char *text = p;
+    while (p < end && !userfile_space(*p)) p++;
+    if (p == text) {
+        uf->pos = uf->size;
+        return 0;
+    }
+
+    size_t len = (size_t)(p - text);
+    line->timestamp = (int)(neg ? -ts : ts);
+    line->text = text;
+    line->len = (uint16_t)(len > USERFILE_MAX_TEXT ? USERFILE_MAX_TEXT : len);
+    uf->pos = (size_t)(p - uf->data);
+    return 1;
+}
+
+/* Drop the mapping's pages before `upto` (a position already consumed) from
+   this process. They stay in the page cache; we just stop holding them. */
+static inline void userfile_release(UserFile *uf, size_t upto) {
+    if (upto - uf->released < USERFILE_RELEASE_CHUNK) return;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t to = upto & ~(page - 1);
+    if (to > uf->released) {
+        madvise((char *)uf->data + uf->released, to - uf->released, MADV_DONTNEED);
+        uf->released = to;
+    }
+}
+
+#endif /* USERFILE_H */
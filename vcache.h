@@ -0,0 +1,130 @@
+/***************************************************
+ * vcache.h
+ *
+ * A bounded cache of verdicts by message text (CHATMOD_VERDICT_CACHE), so a
+ * text seen before - spam, copy-paste, bots - costs a hash and a compare
+ * instead of folding, prefiltering and running the automaton again.
+ *
+ * The table is set-associative: a text hashes to one set of VCACHE_WAYS
+ * entries, and a miss evicts within that set by CLOCK (a hand sweeps the set,
+ * clearing reference bits, and takes the first entry not used since its last
+ * pass). Entries keep the text itself, so a hash collision is a miss rather
+ * than a wrong verdict. Each entry also records the matcher generation it was
+ * computed under; after a reload, older entries simply stop matching.
+ *
+ * One cache per moderator shard, touched by that shard only.
+ ***************************************************/
+#ifndef VCACHE_H
+#define VCACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VCACHE_WAYS 8
+
+typedef struct {
+    uint64_t hash;
+    uint32_t generation;      /* matcher it was computed under; 0 = empty */
+    uint16_t len;
+    uint8_t  ref;             /* used since the hand last passed */
+    int32_t  verdict;
+} VCacheEntry;
+
+typedef struct {
+    VCacheEntry *entries;     /* nsets * VCACHE_WAYS */
+    char *text;               /* text_max bytes per entry */
+    uint8_t *hand;            /* per set */
+    uint32_t set_mask;        /* nsets - 1; nsets is a power of two */
+    uint32_t text_max;
+    uint64_t hits, misses;
+} VCache;
+
+/* A fast 64-bit hash of the text, eight bytes at a time. */
+static inline uint64_t vcache_hash(const char *text, size_t len) {
+    uint64_t h = 0x9E3779B97F4A7C15ull ^ len;
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, text + i, 8);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    if (i < len) {
+        uint64_t w = 0;
+        memcpy(&w, text + i, len - i);
+        h = (h ^ w) * 0xff51afd7ed558ccdull;
+    }
+    h ^= h >> 29;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 32);
+}
+
+/* Room for about `capacity` texts of up to `text_max` bytes. Returns 0, or -1
+   if out of memory. A capacity of 0 leaves the cache disabled. */
+static inline int vcache_init(VCache *c, uint32_t capacity, uint32_t text_max) {
+    memset(c, 0, sizeof(*c));
+    if (capacity == 0) return 0;
+    uint32_t nsets = 1;
+    while (nsets * VCACHE_WAYS < capacity) nsets <<= 1;
+    c->entries = calloc((size_t)nsets * VCACHE_WAYS, sizeof(VCacheEntry));
+    c->text = malloc((size_t)nsets * VCACHE_WAYS * text_max);
+    c->hand = calloc(nsets, 1);
+    if (!c->entries || !c->text || !c->hand) return -1;
+    c->set_mask = nsets - 1;
+    c->text_max = text_max;
+    return 0;
+}
+
+static inline int vcache_enabled(const VCache *c) {
+    return c->entries != NULL;
+}
+
+/* The cached verdict for `text` under matcher `generation`, or -1 on a miss. */
+static inline int32_t vcache_get(VCache *c, uint64_t hash, const char *text, size_t len, uint32_t generation) {
+    uint32_t base = (uint32_t)(hash & c->set_mask) * VCACHE_WAYS;
+    for (uint32_t w = 0; w < VCACHE_WAYS; w++) {
+        VCacheEntry *e = &c->entries[base + w];
+        if (e->hash == hash && e->generation == generation && e->len == len &&
+            memcmp(c->text + (size_t)(base + w) * c->text_max, text, len) == 0) {
+            e->ref = 1;
+            c->hits++;
+            return e->verdict;
+        }
+    }
+    c->misses++;
+    return -1;
+}
+
+/* Remember a verdict, evicting by CLOCK within the text's set. */
+static inline void vcache_put(VCache *c, uint64_t hash, const char *text, size_t len, uint32_t generation,
+                              int32_t verdict) {
+    if (len > c->text_max) return;
+    uint32_t set = (uint32_t)(hash & c->set_mask);
+    uint32_t base = set * VCACHE_WAYS;
+    uint32_t way = VCACHE_WAYS;
+    for (uint32_t w = 0; w < VCACHE_WAYS && way == VCACHE_WAYS; w++) {
+        /* empty, or left over from an older matcher */
+        if (c->entries[base + w].generation != generation) way = w;
+    }
+    if (way == VCACHE_WAYS) {
+        way = c->hand[set];
+        while (c->entries[base + way].ref) {
+            c->entries[base + way].ref = 0;
+            way = (way + 1) % VCACHE_WAYS;
+        }
+        c->hand[set] = (uint8_t)((way + 1) % VCACHE_WAYS);
+    }
+    VCacheEntry *e = &c->entries[base + way];
+    *e = (VCacheEntry){ hash, generation, (uint16_t)len, 0, verdict };
+    memcpy(c->text + (size_t)(base + way) * c->text_max, text, len);
+}
+
+static inline void vcache_free(VCache *c) {
+    free(c->entries);
+    free(c->text);
+    free(c->hand);
+    memset(c, 0, sizeof(*c));
+}
+
+#endif /* VCACHE_H */
@@ -0,0 +1,244 @@
+/***************************************************
+ * vlog.h
+ *
+ * Durable violation counts (CHATMOD_STATE_DIR). Shards never touch the disk:
+ * each pushes a VLogRecord (the pair's new absolute count) into its own
+ * single-producer ring, and one flusher thread drains every ring, appends the
+ * lot to `violations.log` with a single write() and fdatasync()s it (group
+ * commit). Since records carry absolute counts, replaying one twice is
+ * harmless.
+ *
+ * The flusher also applies every record to a mirror VTable. When the log
+ * grows well past the table it writes the mirror out as `violations.snap` -
+ * the raw slot array behind a small header, so recovery is an mmap() and a
+ * memcpy() - renames it into place and starts the log again. Recovery loads
+ * the snapshot, replays the log on top, and drops a torn tail record.
+ ***************************************************/
+#ifndef VLOG_H
+#define VLOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "spsc.h"
+#include "vtable.h"
+
+#define VLOG_MAGIC 0x564c4731u        /* "VLG1" */
+#define VSNAP_MAGIC 0x56534e31u       /* "VSN1" */
+#define VLOG_RING 4096                /* records per shard ring */
+#define VLOG_COMPACT_MIN 65536        /* log records before a snapshot is considered */
+
+typedef struct {
+    uint64_t key;                     /* vtable_key(group, user) */
+    int32_t count;                    /* new absolute count */
+    uint32_t check;                   /* vlog_check(key, count); catches a torn tail */
+} VLogRecord;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t bits;                    /* slots in the snapshot: 1 << bits */
+    uint32_t used;
+    uint32_t pad;
+} VSnapHeader;
+
+/* Shard -> flusher ring. */
+typedef struct {
+    _Alignas(SPSC_CACHELINE) _Atomic uint32_t head;   /* written by the flusher */
+    _Alignas(SPSC_CACHELINE) _Atomic uint32_t tail;   /* written by the shard */
+    VLogRecord slots[VLOG_RING];
+} VLogRing;
+
+typedef struct {
+    int fd;                           /* the log, O_APPEND */
+    int dirfd;
+    uint64_t records;                 /* in the log right now */
+    VTable mirror;                    /* every pair's latest count */
+    VLogRing *rings;
+    int nrings;
+    Doorbell bell;                    /* rung by a shard whose ring is filling up */
+    VLogRecord *buf;                  /* one group commit's worth */
+    uint64_t commits, synced;         /* bookkeeping for the shutdown line */
+} VLog;
+
+static inline uint32_t vlog_check(uint64_t key, int32_t count) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> 32) ^ (uint32_t)count ^ VLOG_MAGIC;
+}
+
+/* Shard side. Blocks (briefly) only if the flusher has fallen a full ring behind. */
+static inline void vlog_push(VLog *v, int ring, uint32_t group, uint32_t user, int32_t count) {
+    VLogRing *r = &v->rings[ring];
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    while (tail - atomic_load_explicit(&r->head, memory_order_acquire) >= VLOG_RING) {
+        doorbell_ring(&v->bell);
+        struct timespec pause = { 0, 100000 };
+        nanosleep(&pause, NULL);
+    }
+    uint64_t key = vtable_key(group, user);
+    r->slots[tail % VLOG_RING] = (VLogRecord){ key, count, vlog_check(key, count) };
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    if (tail + 1 - atomic_load_explicit(&r->head, memory_order_relaxed) == VLOG_RING / 2) {
+        doorbell_ring(&v->bell);
+    }
+}
+
+static inline int vlog_apply(VTable *t, const VLogRecord *r) {
+    int32_t *c = vtable_get(t, (uint32_t)(r->key >> 32), (uint32_t)r->key);
+    if (!c) return -1;
+    *c = r->count;
+    return 0;
+}
+
+static inline int vlog_write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        p += w;
+        len -= (size_t)w;
+    }
+    return 0;
+}
+
+/* Write the mirror as a new snapshot and empty the log. Returns 0 or -1. */
+static inline int vlog_compact(VLog *v) {
+    int fd = openat(v->dirfd, "violations.snap.tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    VSnapHeader h = { VSNAP_MAGIC, v->mirror.bits, v->mirror.used, 0 };
+    if (vlog_write_all(fd, &h, sizeof(h)) < 0 ||
+        vlog_write_all(fd, v->mirror.slots, sizeof(VEntry) << v->mirror.bits) < 0 || fdatasync(fd) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (close(fd) < 0) return -1;
+    if (renameat(v->dirfd, "violations.snap.tmp", v->dirfd, "violations.snap") < 0) return -1;
+    fsync(v->dirfd);
+    /* The snapshot covers the whole log; replaying it again after a crash
+       between the rename and here would be harmless anyway. */
+    if (ftruncate(v->fd, 0) < 0) return -1;
+    fdatasync(v->fd);
+    v->records = 0;
+    return 0;
+}
+
+/* Flusher side: drain every ring, append, sync. Returns records committed, -1 on error. */
+static inline long vlog_commit(VLog *v) {
+    size_t n = 0;
+    for (int i = 0; i < v->nrings; i++) {
+        VLogRing *r = &v->rings[i];
+        uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+        for (; head != tail; head++) {
+            v->buf[n] = r->slots[head % VLOG_RING];
+            if (vlog_apply(&v->mirror, &v->buf[n]) < 0) return -1;
+            n++;
+        }
+        atomic_store_explicit(&r->head, head, memory_order_release);
+    }
+    if (n == 0) return 0;
+    if (vlog_write_all(v->fd, v->buf, n * sizeof(VLogRecord)) < 0 || fdatasync(v->fd) < 0) return -1;
+    v->records += n;
+    v->commits++;
+    v->synced += n;
+    if (v->records >= VLOG_COMPACT_MIN && v->records > 4ull * v->mirror.used && vlog_compact(v) < 0) return -1;
+    return (long)n;
+}
+
+/* Load the snapshot (if any) into the mirror. */
+static inline int vlog_load_snapshot(VLog *v) {
+    int fd = openat(v->dirfd, "violations.snap", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(VSnapHeader)) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+    const VSnapHeader *h = map;
+    int rc = -1;
+    if (h->magic == VSNAP_MAGIC && h->bits >= VTABLE_MIN_BITS && h->bits < 32 &&
+        sizeof(*h) + (sizeof(VEntry) << h->bits) == (size_t)st.st_size) {
+        VEntry *slots = malloc(sizeof(VEntry) << h->bits);
+        if (slots) {
+            memcpy(slots, h + 1, sizeof(VEntry) << h->bits);
+            vtable_free(&v->mirror);
+            v->mirror = (VTable){ slots, h->bits, h->used };
+            rc = 0;
+        }
+    }
+    munmap(map, (size_t)st.st_size);
+    return rc;
+}
+
+/* Replay the log into the mirror and leave it open for appending. */
+static inline int vlog_replay(VLog *v) {
+    v->fd = openat(v->dirfd, "violations.log", O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (v->fd < 0) return -1;
+    struct stat st;
+    if (fstat(v->fd, &st) < 0) return -1;
+    size_t whole = (size_t)st.st_size / sizeof(VLogRecord);
+    if (whole > 0) {
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, v->fd, 0);
+        if (map == MAP_FAILED) return -1;
+        const VLogRecord *r = map;
+        size_t good = 0;
+        while (good < whole && r[good].check == vlog_check(r[good].key, r[good].count)) {
+            if (vlog_apply(&v->mirror, &r[good]) < 0) {
+                munmap(map, (size_t)st.st_size);
+                return -1;
+            }
+            good++;
+        }
+        munmap(map, (size_t)st.st_size);
+        whole = good;
+    }
+    /* Cut a torn or corrupt tail so new records follow the last good one. */
+    if ((off_t)(whole * sizeof(VLogRecord)) != st.st_size &&
+        ftruncate(v->fd, (off_t)(whole * sizeof(VLogRecord))) < 0) {
+        return -1;
+    }
+    v->records = whole;
+    return 0;
+}
+
+/* Open (creating if needed) the state in `dir` and recover it into the mirror.
+   Returns 0 on success, -1 with errno set. */
+static inline int vlog_open(VLog *v, const char *dir, int nrings) {
+    memset(v, 0, sizeof(*v));
+    v->fd = -1;
+    mkdir(dir, 0755);
+    v->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (v->dirfd < 0) return -1;
+    if (vtable_init(&v->mirror) < 0) return -1;
+    v->rings = aligned_alloc(SPSC_CACHELINE, (size_t)(nrings > 0 ? nrings : 1) * sizeof(VLogRing));
+    v->buf = malloc((size_t)(nrings > 0 ? nrings : 1) * VLOG_RING * sizeof(VLogRecord));
+    if (!v->rings || !v->buf) return -1;
+    for (int i = 0; i < nrings; i++) {
+        atomic_init(&v->rings[i].head, 0);
+        atomic_init(&v->rings[i].tail, 0);
+    }
+    v->nrings = nrings;
+    if (vlog_load_snapshot(v) < 0) return -1;
+    return vlog_replay(v);
+}
+
+static inline void vlog_close(VLog *v) {
+    if (v->fd >= 0) close(v->fd);
+    if (v->dirfd >= 0) close(v->dirfd);
+    vtable_free(&v->mirror);
+    free(v->rings);
+    free(v->buf);
+    v->fd = v->dirfd = -1;
+}
+
+#endif /* VLOG_H */
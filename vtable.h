@@ -0,0 +1,129 @@
+/***************************************************
+ * vtable.h
+ *
+ * Violation counts keyed by (group, user), as an open-addressing hash table
+ * with linear probing. Only users that have actually said something filtered
+ * get an entry, so the table stays small however many groups and users the
+ * testcase has, and it grows by doubling when it passes half full. Entries
+ * are 16 bytes, four to a cache line, and at that load a lookup almost
+ * always ends on the first line it touches. Entries can be removed again
+ * (windowed counts that drop to zero).
+ *
+ * Not thread-safe: each moderator shard owns one table.
+ ***************************************************/
+#ifndef VTABLE_H
+#define VTABLE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VTABLE_EMPTY UINT64_MAX
+#define VTABLE_MIN_BITS 6
+
+typedef struct {
+    uint64_t key;   /* group << 32 | user, VTABLE_EMPTY if unused */
+    int32_t count;
+    int32_t pad;
+} VEntry;
+
+typedef struct {
+    VEntry *slots;
+    uint32_t bits;  /* capacity is 1 << bits */
+    uint32_t used;
+} VTable;
+
+static inline uint64_t vtable_key(uint32_t group, uint32_t user) {
+    return (uint64_t)group << 32 | user;
+}
+
+static inline uint32_t vtable_hash(uint64_t key, uint32_t bits) {
+    return (uint32_t)((key * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+}
+
+static inline int vtable_alloc(VTable *t, uint32_t bits) {
+    VEntry *slots = malloc(sizeof(VEntry) << bits);
+    if (!slots) return -1;
+    memset(slots, 0xff, sizeof(VEntry) << bits);
+    t->slots = slots;
+    t->bits = bits;
+    t->used = 0;
+    return 0;
+}
+
+/* Returns 0 on success, -1 if out of memory. */
+static inline int vtable_init(VTable *t) {
+    return vtable_alloc(t, VTABLE_MIN_BITS);
+}
+
+static inline void vtable_free(VTable *t) {
+    free(t->slots);
+    t->slots = NULL;
+    t->bits = t->used = 0;
+}
+
+static inline VEntry *vtable_probe(VEntry *slots, uint32_t bits, uint64_t key) {
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t i = vtable_hash(key, bits);
+    while (slots[i].key != key && slots[i].key != VTABLE_EMPTY) {
+        i = (i + 1) & mask;
+    }
+    return &slots[i];
+}
+
+static inline int vtable_grow(VTable *t) {
+    VTable bigger;
+    if (vtable_alloc(&bigger, t->bits + 1) < 0) return -1;
+    for (uint32_t i = 0; i < (1u << t->bits); i++) {
+        if (t->slots[i].key == VTABLE_EMPTY) continue;
+        *vtable_probe(bigger.slots, bigger.bits, t->slots[i].key) = t->slots[i];
+    }
+    bigger.used = t->used;
+    free(t->slots);
+    *t = bigger;
+    return 0;
+}
+
+/* Count for (group, user), created at zero if missing. NULL only if the
+   table had to grow and could not. */
+static inline int32_t *vtable_get(VTable *t, uint32_t group, uint32_t user) {
+    uint64_t key = vtable_key(group, user);
+    VEntry *e = vtable_probe(t->slots, t->bits, key);
+    if (e->key == key) return &e->count;
+
+    if (2 * (t->used + 1) > (1u << t->bits)) {
+        if (vtable_grow(t) < 0) return NULL;
+        e = vtable_probe(t->slots, t->bits, key);
+    }
+    e->key = key;
+    e->count = 0;
+    t->used++;
+    return &e->count;
+}
+
+/* Count for a key from vtable_key(), NULL if it has no entry. */
+static inline int32_t *vtable_find(VTable *t, uint64_t key) {
+    VEntry *e = vtable_probe(t->slots, t->bits, key);
+    return e->key == key ? &e->count : NULL;
+}
+
+/* Drop a key's entry, if it has one. Later entries of its probe run shift back
+   into the hole, so no tombstones are left behind. */
+static inline void vtable_remove(VTable *t, uint64_t key) {
+    uint32_t mask = (1u << t->bits) - 1;
+    VEntry *e = vtable_probe(t->slots, t->bits, key);
+    if (e->key != key) return;
+    uint32_t hole = (uint32_t)(e - t->slots);
+    for (uint32_t j = (hole + 1) & mask; t->slots[j].key != VTABLE_EMPTY; j = (j + 1) & mask) {
+        uint32_t home = vtable_hash(t->slots[j].key, t->bits);
+        /* Entry j may fill the hole unless its home lies after the hole, up to j. */
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            t->slots[hole] = t->slots[j];
+            hole = j;
+        }
+    }
+    memset(&t->slots[hole], 0xff, sizeof(VEntry));
+    t->used--;
+}
+
+#endif /* VTABLE_H */
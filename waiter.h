@@ -0,0 +1,155 @@
+/***************************************************
+ * waiter.h
+ *
+ * How a loop that has run out of work waits for more (CHATMOD_WAIT): keep
+ * polling for a while, then sched_yield() a few times, then block in the
+ * kernel. Polling answers a new arrival within nanoseconds but burns a CPU;
+ * blocking costs nothing at idle but adds a wakeup (tens of microseconds).
+ *
+ *   block      block at once
+ *   spin       poll for WAIT_SPIN_MAX_NS and yield WAIT_YIELDS times first
+ *   adaptive   (default) poll for about twice the recent average idle gap,
+ *              but only while gaps are short enough for that to pay off;
+ *              at idle it blocks straight away
+ *
+ * Polling needs a second CPU to be useful, so on a single CPU the spin phase
+ * is skipped whatever the mode.
+ *
+ *   waiter_begin(&w);
+ *   while (!ready()) {
+ *       if (!waiter_next(&w)) { block(); break; }
+ *   }
+ *   waiter_end(&w);
+ ***************************************************/
+#ifndef WAITER_H
+#define WAITER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+
+#include "config.h"
+
+#define WAIT_SPIN_MAX_NS 50000ull     /* longest polling phase */
+#define WAIT_YIELDS 8                 /* sched_yield() rounds after polling */
+#define WAIT_CHECK_EVERY 32           /* polls between clock reads */
+
+enum { WAIT_BLOCK, WAIT_SPIN, WAIT_ADAPTIVE };
+
+typedef struct {
+    int mode;
+    int spin_ok;              /* more than one CPU */
+    uint64_t gap_avg_ns;      /* moving average of idle gaps (1/8 weight per sample) */
+    uint64_t started_ns;      /* this wait */
+    uint64_t spin_ns;         /* polling budget for this wait */
+    uint32_t polls;
+    uint32_t yields;
+    uint64_t waits;           /* times the caller ran out of work */
+    uint64_t blocks;          /* ... and went on to block */
+} Waiter;
+
+static inline uint64_t waiter_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void waiter_init(Waiter *w) {
+    const char *mode = env_str("CHATMOD_WAIT", "adaptive");
+    w->mode = !strcmp(mode, "block") ? WAIT_BLOCK : !strcmp(mode, "spin") ? WAIT_SPIN : WAIT_ADAPTIVE;
+    w->spin_ok = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+    w->gap_avg_ns = WAIT_SPIN_MAX_NS;   /* start out willing to poll briefly */
+    w->waits = w->blocks = 0;
+}
+
+static inline void waiter_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/* Out of work: size this wait's polling phase. */
+static inline void waiter_begin(Waiter *w) {
+    w->started_ns = waiter_now_ns();
+    w->polls = 0;
+    w->yields = 0;
+    w->spin_ns = 0;
+    if (w->mode == WAIT_SPIN) {
+        w->spin_ns = WAIT_SPIN_MAX_NS;
+    } else if (w->mode == WAIT_ADAPTIVE && w->gap_avg_ns < WAIT_SPIN_MAX_NS) {
+        w->spin_ns = 2 * w->gap_avg_ns;
+    }
+    if (!w->spin_ok) w->spin_ns = 0;
+}
+
+/* Nothing yet: pause or yield once and return 1 to look again, or 0 to block now. */
+static inline int waiter_next(Waiter *w) {
+    if (w->mode == WAIT_BLOCK) return 0;
+    if (w->spin_ns) {
+        if (++w->polls % WAIT_CHECK_EVERY || waiter_now_ns() - w->started_ns < w->spin_ns) {
+            waiter_cpu_relax();
+            return 1;
+        }
+        w->spin_ns = 0;
+    }
+    /* Yielding is only worth it while work tends to come back soon. */
+    if (w->yields < WAIT_YIELDS && (w->mode == WAIT_SPIN || w->gap_avg_ns < 4 * WAIT_SPIN_MAX_NS)) {
+        w->yields++;
+        sched_yield();
+        return 1;
+    }
+    w->blocks++;
+    return 0;
+}
+
+/* Work arrived (or the caller gave up): fold this gap into the average. */
+static inline void waiter_end(Waiter *w) {
+    uint64_t gap = waiter_now_ns() - w->started_ns;
+    if (gap > w->gap_avg_ns) w->gap_avg_ns += (gap - w->gap_avg_ns) / 8;
+    else w->gap_avg_ns -= (w->gap_avg_ns - gap) / 8;
+    w->waits++;
+}
+
+/* msgrcv() through the wait strategy: IPC_NOWAIT polls first, then a blocking call. */
+static inline ssize_t waiter_msgrcv(Waiter *w, int msqid, void *msg, size_t size, long type) {
+    ssize_t r = msgrcv(msqid, msg, size, type, IPC_NOWAIT);
+    if (r >= 0 || errno != ENOMSG) return r;
+    waiter_begin(w);
+    while ((r = msgrcv(msqid, msg, size, type, IPC_NOWAIT)) < 0 && errno == ENOMSG) {
+        if (!waiter_next(w)) {
+            r = msgrcv(msqid, msg, size, type, 0);
+            break;
+        }
+    }
+    waiter_end(w);
+    return r;
+}
+
+/* epoll_wait() through the wait strategy. A zero timeout is just a poll; a positive
+   one counts from the call, so time spent polling comes off what is left to block. */
+static inline int waiter_epoll(Waiter *w, int epfd, struct epoll_event *events, int max, int timeout) {
+    int n = epoll_wait(epfd, events, max, 0);
+    if (n != 0 || timeout == 0) return n;
+    waiter_begin(w);
+    while ((n = epoll_wait(epfd, events, max, 0)) == 0) {
+        if (!waiter_next(w)) {
+            int left = timeout;
+            if (timeout > 0) {
+                uint64_t spent_ms = (waiter_now_ns() - w->started_ns) / 1000000;
+                left = spent_ms < (uint64_t)timeout ? timeout - (int)spent_ms : 0;
+            }
+            n = epoll_wait(epfd, events, max, left);
+            break;
+        }
+    }
+    waiter_end(w);
+    return n;
+}
+
+#endif /* WAITER_H */